@@ -104,6 +104,118 @@ extern "C" SEXP _orion_create_sliding_midpoint_tree_3(SEXP points, SEXP bucket)
   END_CPP11
 }
 // tree.cpp
+fair_tree_2_double_p create_fair_tree_2_double(SEXP points, int bucket, double aspect, int threads);
+extern "C" SEXP _orion_create_fair_tree_2_double(SEXP points, SEXP bucket, SEXP aspect, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_fair_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<double>>(aspect), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+fair_tree_3_double_p create_fair_tree_3_double(SEXP points, int bucket, double aspect, int threads);
+extern "C" SEXP _orion_create_fair_tree_3_double(SEXP points, SEXP bucket, SEXP aspect, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_fair_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<double>>(aspect), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+median_of_max_spread_tree_2_double_p create_median_of_max_spread_tree_2_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_median_of_max_spread_tree_2_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_median_of_max_spread_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+median_of_max_spread_tree_3_double_p create_median_of_max_spread_tree_3_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_median_of_max_spread_tree_3_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_median_of_max_spread_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+median_of_rectangle_tree_2_double_p create_median_of_rectangle_tree_2_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_median_of_rectangle_tree_2_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_median_of_rectangle_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+median_of_rectangle_tree_3_double_p create_median_of_rectangle_tree_3_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_median_of_rectangle_tree_3_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_median_of_rectangle_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+midpoint_of_max_spread_tree_2_double_p create_midpoint_of_max_spread_tree_2_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_midpoint_of_max_spread_tree_2_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_midpoint_of_max_spread_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+midpoint_of_max_spread_tree_3_double_p create_midpoint_of_max_spread_tree_3_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_midpoint_of_max_spread_tree_3_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_midpoint_of_max_spread_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+midpoint_of_rectangle_tree_2_double_p create_midpoint_of_rectangle_tree_2_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_midpoint_of_rectangle_tree_2_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_midpoint_of_rectangle_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+midpoint_of_rectangle_tree_3_double_p create_midpoint_of_rectangle_tree_3_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_midpoint_of_rectangle_tree_3_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_midpoint_of_rectangle_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+sliding_fair_tree_2_double_p create_sliding_fair_tree_2_double(SEXP points, int bucket, double aspect, int threads);
+extern "C" SEXP _orion_create_sliding_fair_tree_2_double(SEXP points, SEXP bucket, SEXP aspect, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_sliding_fair_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<double>>(aspect), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+sliding_fair_tree_3_double_p create_sliding_fair_tree_3_double(SEXP points, int bucket, double aspect, int threads);
+extern "C" SEXP _orion_create_sliding_fair_tree_3_double(SEXP points, SEXP bucket, SEXP aspect, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_sliding_fair_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<double>>(aspect), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+sliding_midpoint_tree_2_double_p create_sliding_midpoint_tree_2_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_sliding_midpoint_tree_2_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_sliding_midpoint_tree_2_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+sliding_midpoint_tree_3_double_p create_sliding_midpoint_tree_3_double(SEXP points, int bucket, int threads);
+extern "C" SEXP _orion_create_sliding_midpoint_tree_3_double(SEXP points, SEXP bucket, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(create_sliding_midpoint_tree_3_double(cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<int>>(bucket), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+tree_base_p tree_flatten(tree_base_p tree);
+extern "C" SEXP _orion_tree_flatten(SEXP tree) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_flatten(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree)));
+  END_CPP11
+}
+// tree.cpp
+tree_base_p tree_load(std::string file);
+extern "C" SEXP _orion_tree_load(SEXP file) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_load(cpp11::as_cpp<cpp11::decay_t<std::string>>(file)));
+  END_CPP11
+}
+// tree.cpp
 cpp11::writable::integers tree_dimension(tree_base_p tree);
 extern "C" SEXP _orion_tree_dimension(SEXP tree) {
   BEGIN_CPP11
@@ -118,6 +230,20 @@ extern "C" SEXP _orion_tree_split_type(SEXP tree) {
   END_CPP11
 }
 // tree.cpp
+cpp11::writable::strings tree_precision(tree_base_p tree);
+extern "C" SEXP _orion_tree_precision(SEXP tree) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_precision(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree)));
+  END_CPP11
+}
+// tree.cpp
+cpp11::writable::strings tree_engine(tree_base_p tree);
+extern "C" SEXP _orion_tree_engine(SEXP tree) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_engine(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree)));
+  END_CPP11
+}
+// tree.cpp
 cpp11::writable::integers tree_size(tree_base_p tree);
 extern "C" SEXP _orion_tree_size(SEXP tree) {
   BEGIN_CPP11
@@ -146,6 +272,20 @@ extern "C" SEXP _orion_tree_points(SEXP tree) {
   END_CPP11
 }
 // tree.cpp
+SEXP tree_shape(tree_base_p tree);
+extern "C" SEXP _orion_tree_shape(SEXP tree) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_shape(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree)));
+  END_CPP11
+}
+// tree.cpp
+bool tree_weighted(tree_base_p tree);
+extern "C" SEXP _orion_tree_weighted(SEXP tree) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_weighted(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree)));
+  END_CPP11
+}
+// tree.cpp
 SEXP tree_bbox(tree_base_p tree);
 extern "C" SEXP _orion_tree_bbox(SEXP tree) {
   BEGIN_CPP11
@@ -153,69 +293,204 @@ extern "C" SEXP _orion_tree_bbox(SEXP tree) {
   END_CPP11
 }
 // tree.cpp
-SEXP tree_point_search(tree_base_p tree, SEXP points, cpp11::integers n, SEXP eps, bool nearest, bool sort);
-extern "C" SEXP _orion_tree_point_search(SEXP tree, SEXP points, SEXP n, SEXP eps, SEXP nearest, SEXP sort) {
+SEXP tree_point_search(tree_base_p tree, SEXP points, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder, std::string metric, double p, cpp11::doubles weights);
+extern "C" SEXP _orion_tree_point_search(SEXP tree, SEXP points, SEXP n, SEXP eps, SEXP max_distance, SEXP max_leaves, SEXP nearest, SEXP sort, SEXP index, SEXP stats, SEXP threads, SEXP reorder, SEXP metric, SEXP p, SEXP weights) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_point_search(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(n), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(max_distance), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(max_leaves), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest), cpp11::as_cpp<cpp11::decay_t<bool>>(sort), cpp11::as_cpp<cpp11::decay_t<bool>>(index), cpp11::as_cpp<cpp11::decay_t<bool>>(stats), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(reorder), cpp11::as_cpp<cpp11::decay_t<std::string>>(metric), cpp11::as_cpp<cpp11::decay_t<double>>(p), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(weights)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_spheroid_search(tree_base_p tree, SEXP spheroids, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder);
+extern "C" SEXP _orion_tree_spheroid_search(SEXP tree, SEXP spheroids, SEXP n, SEXP eps, SEXP max_distance, SEXP max_leaves, SEXP nearest, SEXP sort, SEXP index, SEXP stats, SEXP threads, SEXP reorder) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_spheroid_search(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(spheroids), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(n), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(max_distance), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(max_leaves), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest), cpp11::as_cpp<cpp11::decay_t<bool>>(sort), cpp11::as_cpp<cpp11::decay_t<bool>>(index), cpp11::as_cpp<cpp11::decay_t<bool>>(stats), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(reorder)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_box_search(tree_base_p tree, SEXP boxes, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder);
+extern "C" SEXP _orion_tree_box_search(SEXP tree, SEXP boxes, SEXP n, SEXP eps, SEXP max_distance, SEXP max_leaves, SEXP nearest, SEXP sort, SEXP index, SEXP stats, SEXP threads, SEXP reorder) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_box_search(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(boxes), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(n), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(max_distance), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(max_leaves), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest), cpp11::as_cpp<cpp11::decay_t<bool>>(sort), cpp11::as_cpp<cpp11::decay_t<bool>>(index), cpp11::as_cpp<cpp11::decay_t<bool>>(stats), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(reorder)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_spheroid_range(tree_base_p tree, SEXP spheroids, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique);
+extern "C" SEXP _orion_tree_spheroid_range(SEXP tree, SEXP spheroids, SEXP eps, SEXP index, SEXP stats, SEXP threads, SEXP reorder, SEXP unique) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_spheroid_range(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(spheroids), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(index), cpp11::as_cpp<cpp11::decay_t<bool>>(stats), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(reorder), cpp11::as_cpp<cpp11::decay_t<bool>>(unique)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_box_range(tree_base_p tree, SEXP boxes, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique);
+extern "C" SEXP _orion_tree_box_range(SEXP tree, SEXP boxes, SEXP eps, SEXP index, SEXP stats, SEXP threads, SEXP reorder, SEXP unique) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_box_range(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(boxes), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(index), cpp11::as_cpp<cpp11::decay_t<bool>>(stats), cpp11::as_cpp<cpp11::decay_t<int>>(threads), cpp11::as_cpp<cpp11::decay_t<bool>>(reorder), cpp11::as_cpp<cpp11::decay_t<bool>>(unique)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_spheroid_count(tree_base_p tree, SEXP spheroids, SEXP eps, bool any, int threads);
+extern "C" SEXP _orion_tree_spheroid_count(SEXP tree, SEXP spheroids, SEXP eps, SEXP any, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_spheroid_count(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(spheroids), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(any), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_box_count(tree_base_p tree, SEXP boxes, SEXP eps, bool any, int threads);
+extern "C" SEXP _orion_tree_box_count(SEXP tree, SEXP boxes, SEXP eps, SEXP any, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_box_count(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(boxes), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(any), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_spheroid_aggregate(tree_base_p tree, SEXP spheroids, SEXP eps, int threads);
+extern "C" SEXP _orion_tree_spheroid_aggregate(SEXP tree, SEXP spheroids, SEXP eps, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_spheroid_aggregate(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(spheroids), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_box_aggregate(tree_base_p tree, SEXP boxes, SEXP eps, int threads);
+extern "C" SEXP _orion_tree_box_aggregate(SEXP tree, SEXP boxes, SEXP eps, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_box_aggregate(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(boxes), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_knn_graph(tree_base_p tree, int k, int threads);
+extern "C" SEXP _orion_tree_knn_graph(SEXP tree, SEXP k, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_knn_graph(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<int>>(k), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+SEXP tree_join(tree_base_p tree_a, tree_base_p tree_b, double r, double eps, int threads);
+extern "C" SEXP _orion_tree_join(SEXP tree_a, SEXP tree_b, SEXP r, SEXP eps, SEXP threads) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_join(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree_a), cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree_b), cpp11::as_cpp<cpp11::decay_t<double>>(r), cpp11::as_cpp<cpp11::decay_t<double>>(eps), cpp11::as_cpp<cpp11::decay_t<int>>(threads)));
+  END_CPP11
+}
+// tree.cpp
+neighbor_cursor_p tree_cursor(tree_base_p tree, SEXP point, bool nearest);
+extern "C" SEXP _orion_tree_cursor(SEXP tree, SEXP point, SEXP nearest) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(tree_cursor(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(point), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest)));
+  END_CPP11
+}
+// tree.cpp
+SEXP cursor_next(neighbor_cursor_p cursor, int n, bool index);
+extern "C" SEXP _orion_cursor_next(SEXP cursor, SEXP n, SEXP index) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cursor_next(cpp11::as_cpp<cpp11::decay_t<neighbor_cursor_p>>(cursor), cpp11::as_cpp<cpp11::decay_t<int>>(n), cpp11::as_cpp<cpp11::decay_t<bool>>(index)));
+  END_CPP11
+}
+// tree.cpp
+bool cursor_exhausted(neighbor_cursor_p cursor);
+extern "C" SEXP _orion_cursor_exhausted(SEXP cursor) {
+  BEGIN_CPP11
+    return cpp11::as_sexp(cursor_exhausted(cpp11::as_cpp<cpp11::decay_t<neighbor_cursor_p>>(cursor)));
+  END_CPP11
+}
+// tree.cpp
+int cursor_position(neighbor_cursor_p cursor);
+extern "C" SEXP _orion_cursor_position(SEXP cursor) {
   BEGIN_CPP11
-    return cpp11::as_sexp(tree_point_search(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(n), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest), cpp11::as_cpp<cpp11::decay_t<bool>>(sort)));
+    return cpp11::as_sexp(cursor_position(cpp11::as_cpp<cpp11::decay_t<neighbor_cursor_p>>(cursor)));
   END_CPP11
 }
 // tree.cpp
-SEXP tree_spheroid_search(tree_base_p tree, SEXP spheroids, cpp11::integers n, SEXP eps, bool nearest, bool sort);
-extern "C" SEXP _orion_tree_spheroid_search(SEXP tree, SEXP spheroids, SEXP n, SEXP eps, SEXP nearest, SEXP sort) {
+cpp11::writable::integers tree_insert(tree_base_p tree, SEXP points, cpp11::doubles weights);
+extern "C" SEXP _orion_tree_insert(SEXP tree, SEXP points, SEXP weights) {
   BEGIN_CPP11
-    return cpp11::as_sexp(tree_spheroid_search(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(spheroids), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(n), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest), cpp11::as_cpp<cpp11::decay_t<bool>>(sort)));
+    return cpp11::as_sexp(tree_insert(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(points), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(weights)));
   END_CPP11
 }
 // tree.cpp
-SEXP tree_box_search(tree_base_p tree, SEXP boxes, cpp11::integers n, SEXP eps, bool nearest, bool sort);
-extern "C" SEXP _orion_tree_box_search(SEXP tree, SEXP boxes, SEXP n, SEXP eps, SEXP nearest, SEXP sort) {
+void tree_remove(tree_base_p tree, cpp11::integers index);
+extern "C" SEXP _orion_tree_remove(SEXP tree, SEXP index) {
   BEGIN_CPP11
-    return cpp11::as_sexp(tree_box_search(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(boxes), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(n), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps), cpp11::as_cpp<cpp11::decay_t<bool>>(nearest), cpp11::as_cpp<cpp11::decay_t<bool>>(sort)));
+    tree_remove(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<cpp11::integers>>(index));
+    return R_NilValue;
   END_CPP11
 }
 // tree.cpp
-SEXP tree_spheroid_range(tree_base_p tree, SEXP spheroids, SEXP eps);
-extern "C" SEXP _orion_tree_spheroid_range(SEXP tree, SEXP spheroids, SEXP eps) {
+void tree_set_weights(tree_base_p tree, cpp11::doubles weights);
+extern "C" SEXP _orion_tree_set_weights(SEXP tree, SEXP weights) {
   BEGIN_CPP11
-    return cpp11::as_sexp(tree_spheroid_range(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(spheroids), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps)));
+    tree_set_weights(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<cpp11::doubles>>(weights));
+    return R_NilValue;
   END_CPP11
 }
 // tree.cpp
-SEXP tree_box_range(tree_base_p tree, SEXP boxes, SEXP eps);
-extern "C" SEXP _orion_tree_box_range(SEXP tree, SEXP boxes, SEXP eps) {
+void tree_save(tree_base_p tree, std::string file);
+extern "C" SEXP _orion_tree_save(SEXP tree, SEXP file) {
   BEGIN_CPP11
-    return cpp11::as_sexp(tree_box_range(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<SEXP>>(boxes), cpp11::as_cpp<cpp11::decay_t<SEXP>>(eps)));
+    tree_save(cpp11::as_cpp<cpp11::decay_t<tree_base_p>>(tree), cpp11::as_cpp<cpp11::decay_t<std::string>>(file));
+    return R_NilValue;
   END_CPP11
 }
 
 extern "C" {
 static const R_CallMethodDef CallEntries[] = {
-    {"_orion_create_fair_tree_2",                   (DL_FUNC) &_orion_create_fair_tree_2,                   3},
-    {"_orion_create_fair_tree_3",                   (DL_FUNC) &_orion_create_fair_tree_3,                   3},
-    {"_orion_create_median_of_max_spread_tree_2",   (DL_FUNC) &_orion_create_median_of_max_spread_tree_2,   2},
-    {"_orion_create_median_of_max_spread_tree_3",   (DL_FUNC) &_orion_create_median_of_max_spread_tree_3,   2},
-    {"_orion_create_median_of_rectangle_tree_2",    (DL_FUNC) &_orion_create_median_of_rectangle_tree_2,    2},
-    {"_orion_create_median_of_rectangle_tree_3",    (DL_FUNC) &_orion_create_median_of_rectangle_tree_3,    2},
-    {"_orion_create_midpoint_of_max_spread_tree_2", (DL_FUNC) &_orion_create_midpoint_of_max_spread_tree_2, 2},
-    {"_orion_create_midpoint_of_max_spread_tree_3", (DL_FUNC) &_orion_create_midpoint_of_max_spread_tree_3, 2},
-    {"_orion_create_midpoint_of_rectangle_tree_2",  (DL_FUNC) &_orion_create_midpoint_of_rectangle_tree_2,  2},
-    {"_orion_create_midpoint_of_rectangle_tree_3",  (DL_FUNC) &_orion_create_midpoint_of_rectangle_tree_3,  2},
-    {"_orion_create_sliding_fair_tree_2",           (DL_FUNC) &_orion_create_sliding_fair_tree_2,           3},
-    {"_orion_create_sliding_fair_tree_3",           (DL_FUNC) &_orion_create_sliding_fair_tree_3,           3},
-    {"_orion_create_sliding_midpoint_tree_2",       (DL_FUNC) &_orion_create_sliding_midpoint_tree_2,       2},
-    {"_orion_create_sliding_midpoint_tree_3",       (DL_FUNC) &_orion_create_sliding_midpoint_tree_3,       2},
-    {"_orion_tree_aspect_ratio",                    (DL_FUNC) &_orion_tree_aspect_ratio,                    1},
-    {"_orion_tree_bbox",                            (DL_FUNC) &_orion_tree_bbox,                            1},
-    {"_orion_tree_box_range",                       (DL_FUNC) &_orion_tree_box_range,                       3},
-    {"_orion_tree_box_search",                      (DL_FUNC) &_orion_tree_box_search,                      6},
-    {"_orion_tree_bucket_size",                     (DL_FUNC) &_orion_tree_bucket_size,                     1},
-    {"_orion_tree_dimension",                       (DL_FUNC) &_orion_tree_dimension,                       1},
-    {"_orion_tree_point_search",                    (DL_FUNC) &_orion_tree_point_search,                    6},
-    {"_orion_tree_points",                          (DL_FUNC) &_orion_tree_points,                          1},
-    {"_orion_tree_size",                            (DL_FUNC) &_orion_tree_size,                            1},
-    {"_orion_tree_spheroid_range",                  (DL_FUNC) &_orion_tree_spheroid_range,                  3},
-    {"_orion_tree_spheroid_search",                 (DL_FUNC) &_orion_tree_spheroid_search,                 6},
-    {"_orion_tree_split_type",                      (DL_FUNC) &_orion_tree_split_type,                      1},
+    {"_orion_create_fair_tree_2",                          (DL_FUNC) &_orion_create_fair_tree_2,                          3},
+    {"_orion_create_fair_tree_2_double",                   (DL_FUNC) &_orion_create_fair_tree_2_double,                   4},
+    {"_orion_create_fair_tree_3",                          (DL_FUNC) &_orion_create_fair_tree_3,                          3},
+    {"_orion_create_fair_tree_3_double",                   (DL_FUNC) &_orion_create_fair_tree_3_double,                   4},
+    {"_orion_create_median_of_max_spread_tree_2",          (DL_FUNC) &_orion_create_median_of_max_spread_tree_2,          2},
+    {"_orion_create_median_of_max_spread_tree_2_double",   (DL_FUNC) &_orion_create_median_of_max_spread_tree_2_double,   3},
+    {"_orion_create_median_of_max_spread_tree_3",          (DL_FUNC) &_orion_create_median_of_max_spread_tree_3,          2},
+    {"_orion_create_median_of_max_spread_tree_3_double",   (DL_FUNC) &_orion_create_median_of_max_spread_tree_3_double,   3},
+    {"_orion_create_median_of_rectangle_tree_2",           (DL_FUNC) &_orion_create_median_of_rectangle_tree_2,           2},
+    {"_orion_create_median_of_rectangle_tree_2_double",    (DL_FUNC) &_orion_create_median_of_rectangle_tree_2_double,    3},
+    {"_orion_create_median_of_rectangle_tree_3",           (DL_FUNC) &_orion_create_median_of_rectangle_tree_3,           2},
+    {"_orion_create_median_of_rectangle_tree_3_double",    (DL_FUNC) &_orion_create_median_of_rectangle_tree_3_double,    3},
+    {"_orion_create_midpoint_of_max_spread_tree_2",        (DL_FUNC) &_orion_create_midpoint_of_max_spread_tree_2,        2},
+    {"_orion_create_midpoint_of_max_spread_tree_2_double", (DL_FUNC) &_orion_create_midpoint_of_max_spread_tree_2_double, 3},
+    {"_orion_create_midpoint_of_max_spread_tree_3",        (DL_FUNC) &_orion_create_midpoint_of_max_spread_tree_3,        2},
+    {"_orion_create_midpoint_of_max_spread_tree_3_double", (DL_FUNC) &_orion_create_midpoint_of_max_spread_tree_3_double, 3},
+    {"_orion_create_midpoint_of_rectangle_tree_2",         (DL_FUNC) &_orion_create_midpoint_of_rectangle_tree_2,         2},
+    {"_orion_create_midpoint_of_rectangle_tree_2_double",  (DL_FUNC) &_orion_create_midpoint_of_rectangle_tree_2_double,  3},
+    {"_orion_create_midpoint_of_rectangle_tree_3",         (DL_FUNC) &_orion_create_midpoint_of_rectangle_tree_3,         2},
+    {"_orion_create_midpoint_of_rectangle_tree_3_double",  (DL_FUNC) &_orion_create_midpoint_of_rectangle_tree_3_double,  3},
+    {"_orion_create_sliding_fair_tree_2",                  (DL_FUNC) &_orion_create_sliding_fair_tree_2,                  3},
+    {"_orion_create_sliding_fair_tree_2_double",           (DL_FUNC) &_orion_create_sliding_fair_tree_2_double,           4},
+    {"_orion_create_sliding_fair_tree_3",                  (DL_FUNC) &_orion_create_sliding_fair_tree_3,                  3},
+    {"_orion_create_sliding_fair_tree_3_double",           (DL_FUNC) &_orion_create_sliding_fair_tree_3_double,           4},
+    {"_orion_create_sliding_midpoint_tree_2",              (DL_FUNC) &_orion_create_sliding_midpoint_tree_2,              2},
+    {"_orion_create_sliding_midpoint_tree_2_double",       (DL_FUNC) &_orion_create_sliding_midpoint_tree_2_double,       3},
+    {"_orion_create_sliding_midpoint_tree_3",              (DL_FUNC) &_orion_create_sliding_midpoint_tree_3,              2},
+    {"_orion_create_sliding_midpoint_tree_3_double",       (DL_FUNC) &_orion_create_sliding_midpoint_tree_3_double,       3},
+    {"_orion_cursor_exhausted",                            (DL_FUNC) &_orion_cursor_exhausted,                            1},
+    {"_orion_cursor_next",                                 (DL_FUNC) &_orion_cursor_next,                                 3},
+    {"_orion_cursor_position",                             (DL_FUNC) &_orion_cursor_position,                             1},
+    {"_orion_tree_aspect_ratio",                           (DL_FUNC) &_orion_tree_aspect_ratio,                           1},
+    {"_orion_tree_bbox",                                   (DL_FUNC) &_orion_tree_bbox,                                   1},
+    {"_orion_tree_box_aggregate",                          (DL_FUNC) &_orion_tree_box_aggregate,                          4},
+    {"_orion_tree_box_count",                              (DL_FUNC) &_orion_tree_box_count,                              5},
+    {"_orion_tree_box_range",                              (DL_FUNC) &_orion_tree_box_range,                              8},
+    {"_orion_tree_box_search",                             (DL_FUNC) &_orion_tree_box_search,                             12},
+    {"_orion_tree_bucket_size",                            (DL_FUNC) &_orion_tree_bucket_size,                            1},
+    {"_orion_tree_cursor",                                 (DL_FUNC) &_orion_tree_cursor,                                 3},
+    {"_orion_tree_dimension",                              (DL_FUNC) &_orion_tree_dimension,                              1},
+    {"_orion_tree_engine",                                 (DL_FUNC) &_orion_tree_engine,                                 1},
+    {"_orion_tree_flatten",                                (DL_FUNC) &_orion_tree_flatten,                                1},
+    {"_orion_tree_insert",                                 (DL_FUNC) &_orion_tree_insert,                                 3},
+    {"_orion_tree_join",                                   (DL_FUNC) &_orion_tree_join,                                   5},
+    {"_orion_tree_knn_graph",                              (DL_FUNC) &_orion_tree_knn_graph,                              3},
+    {"_orion_tree_load",                                   (DL_FUNC) &_orion_tree_load,                                   1},
+    {"_orion_tree_point_search",                           (DL_FUNC) &_orion_tree_point_search,                           15},
+    {"_orion_tree_points",                                 (DL_FUNC) &_orion_tree_points,                                 1},
+    {"_orion_tree_precision",                              (DL_FUNC) &_orion_tree_precision,                              1},
+    {"_orion_tree_remove",                                 (DL_FUNC) &_orion_tree_remove,                                 2},
+    {"_orion_tree_save",                                   (DL_FUNC) &_orion_tree_save,                                   2},
+    {"_orion_tree_set_weights",                            (DL_FUNC) &_orion_tree_set_weights,                            2},
+    {"_orion_tree_shape",                                  (DL_FUNC) &_orion_tree_shape,                                  1},
+    {"_orion_tree_size",                                   (DL_FUNC) &_orion_tree_size,                                   1},
+    {"_orion_tree_spheroid_aggregate",                     (DL_FUNC) &_orion_tree_spheroid_aggregate,                     4},
+    {"_orion_tree_spheroid_count",                         (DL_FUNC) &_orion_tree_spheroid_count,                         5},
+    {"_orion_tree_spheroid_range",                         (DL_FUNC) &_orion_tree_spheroid_range,                         8},
+    {"_orion_tree_spheroid_search",                        (DL_FUNC) &_orion_tree_spheroid_search,                        12},
+    {"_orion_tree_split_type",                             (DL_FUNC) &_orion_tree_split_type,                             1},
+    {"_orion_tree_weighted",                               (DL_FUNC) &_orion_tree_weighted,                               1},
     {NULL, NULL, 0}
 };
 }
@@ -0,0 +1,299 @@
+#pragma once
+
+#include "flat_layout.h"
+#include "leaf_scan.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Dual-tree traversals over trees in the flat layout. Rather than searching
+// from the root once per point, these walk pairs of nodes (from the same tree
+// or from two trees) and settle a whole pair of subtrees in a single test
+// where possible. Distances are squared euclidean
+
+// A tree in the flat layout as read from an image
+template<size_t dim>
+struct flat_view {
+  const flat_header* header;
+  const flat_node* nodes;
+  const uint64_t* index;
+  const double* coords[dim];
+
+  flat_view(const char* data) {
+    header = reinterpret_cast<const flat_header*>(data);
+    nodes = reinterpret_cast<const flat_node*>(data + flat_nodes_offset());
+    index = reinterpret_cast<const uint64_t*>(data + flat_index_offset(header->n_nodes));
+    const double* start = reinterpret_cast<const double*>(data + flat_coords_offset(header->n_nodes, header->n_points));
+    for (size_t d = 0; d < dim; ++d) {
+      coords[d] = start + d * header->n_points;
+    }
+  }
+  size_t size() const { return header->n_points; }
+};
+
+inline bool flat_empty(const flat_node& node) { return node.begin == node.end; }
+inline size_t flat_count(const flat_node& node) { return node.end - node.begin; }
+
+// The smallest and largest distance between any two points in the bounds of
+// two nodes, and the smallest distance from a point to the bounds of a node
+template<size_t dim>
+inline double flat_min_distance(const flat_node& a, const flat_node& b) {
+  double res = 0.0;
+  for (size_t d = 0; d < dim; ++d) {
+    double diff = std::max(std::max(a.low[d] - b.high[d], b.low[d] - a.high[d]), 0.0);
+    res += diff * diff;
+  }
+  return res;
+}
+template<size_t dim>
+inline double flat_max_distance(const flat_node& a, const flat_node& b) {
+  double res = 0.0;
+  for (size_t d = 0; d < dim; ++d) {
+    double diff = std::max(a.high[d] - b.low[d], b.high[d] - a.low[d]);
+    res += diff * diff;
+  }
+  return res;
+}
+template<size_t dim>
+inline double flat_min_distance(const double* p, const flat_node& node) {
+  double res = 0.0;
+  for (size_t d = 0; d < dim; ++d) {
+    double diff = std::max(std::max(node.low[d] - p[d], p[d] - node.high[d]), 0.0);
+    res += diff * diff;
+  }
+  return res;
+}
+
+// Splits the largest subtree until there are enough to keep the threads busy.
+// Each subtree is traversed as a unit of work
+inline std::vector<size_t> flat_subtree_roots(const flat_node* nodes, size_t threads) {
+  std::vector<size_t> roots(1, 0);
+  if (threads <= 1) {
+    return roots;
+  }
+  while (roots.size() < threads * 4) {
+    size_t largest = roots.size();
+    for (size_t i = 0; i < roots.size(); ++i) {
+      const flat_node& node = nodes[roots[i]];
+      if (node.is_leaf()) continue;
+      if (largest == roots.size() || flat_count(node) > flat_count(nodes[roots[largest]])) {
+        largest = i;
+      }
+    }
+    if (largest == roots.size()) {
+      break;
+    }
+    size_t split = roots[largest];
+    roots[largest] = split + 1;
+    roots.push_back(nodes[split].upper);
+  }
+  return roots;
+}
+
+// All k nearest neighbors of the points of a tree. Each query node keeps the
+// largest k-th neighbor distance of the points below it, and a pair is pruned
+// once the reference node lies beyond it. A point is never its own neighbor
+template<size_t dim>
+class flat_knn_graph {
+public:
+  typedef std::pair<double, size_t> Hit;
+
+private:
+  const flat_view<dim>& _tree;
+  size_t _k;
+  // The candidates of each point in tree order, kept as a heap with the worst
+  // candidate on top
+  std::vector<Hit> _heaps;
+  std::vector<size_t> _n_hits;
+  // The largest k-th neighbor distance found so far below each query node
+  std::vector<double> _bounds;
+
+public:
+  flat_knn_graph(const flat_view<dim>& tree, size_t k) :
+    _tree(tree),
+    _k(tree.size() == 0 ? 0 : std::min(k, tree.size() - 1)),
+    _heaps(tree.size() * _k), _n_hits(tree.size(), 0),
+    _bounds(tree.header->n_nodes, std::numeric_limits<double>::infinity()) {}
+
+  size_t k() const { return _k; }
+
+  // Subtrees of query nodes are traversed against the full tree concurrently.
+  // The candidates and bounds of a query node are only written by the thread
+  // handling the subtree holding it so the threads never share state. The
+  // neighbors of each point are sorted by distance once its subtree is done
+  void run(size_t threads) {
+    if (_k == 0) {
+      return;
+    }
+    std::vector<size_t> roots = flat_subtree_roots(_tree.nodes, threads);
+    parallel_for(roots.size(), threads, [&](size_t i) {
+      traverse(roots[i], 0);
+      const flat_node& root = _tree.nodes[roots[i]];
+      for (size_t j = root.begin; j < root.end; ++j) {
+        std::sort_heap(_heaps.begin() + j * _k, _heaps.begin() + j * _k + _n_hits[j]);
+      }
+    });
+  }
+
+  // The neighbors of the point at position j in tree order, nearest first
+  const Hit* neighbors(size_t j) const { return _heaps.data() + j * _k; }
+  size_t n_neighbors(size_t j) const { return _n_hits[j]; }
+
+private:
+  double kth_distance(size_t j) const {
+    return _n_hits[j] == _k ? _heaps[j * _k].first : std::numeric_limits<double>::infinity();
+  }
+  // Empty nodes have no points waiting for neighbors and never loosen the
+  // bound of their parent
+  double child_bound(size_t i) const {
+    return flat_empty(_tree.nodes[i]) ? 0.0 : _bounds[i];
+  }
+
+  void traverse(size_t q, size_t r) {
+    const flat_node& query = _tree.nodes[q];
+    const flat_node& ref = _tree.nodes[r];
+    if (flat_empty(query) || flat_empty(ref) || flat_min_distance<dim>(query, ref) > _bounds[q]) {
+      return;
+    }
+    if (query.is_leaf() && ref.is_leaf()) {
+      base_case(q, r);
+      return;
+    }
+    // The larger of the two nodes is split, with queries split on ties
+    if (ref.is_leaf() || (!query.is_leaf() && flat_count(query) >= flat_count(ref))) {
+      traverse(q + 1, r);
+      traverse(query.upper, r);
+      _bounds[q] = std::max(child_bound(q + 1), child_bound(query.upper));
+      return;
+    }
+    // The closest reference child is visited first to tighten the bound early
+    size_t children[2] = {r + 1, ref.upper};
+    if (flat_min_distance<dim>(query, _tree.nodes[children[1]]) < flat_min_distance<dim>(query, _tree.nodes[children[0]])) {
+      std::swap(children[0], children[1]);
+    }
+    traverse(q, children[0]);
+    traverse(q, children[1]);
+  }
+
+  void base_case(size_t q, size_t r) {
+    const flat_node& query = _tree.nodes[q];
+    const flat_node& ref = _tree.nodes[r];
+    double p[dim];
+    double distances[LEAF_BLOCK];
+    double bound = 0.0;
+    for (size_t j = query.begin; j < query.end; ++j) {
+      for (size_t d = 0; d < dim; ++d) p[d] = _tree.coords[d][j];
+      if (flat_min_distance<dim>(p, ref) <= kth_distance(j)) {
+        Hit* heap = _heaps.data() + j * _k;
+        for (size_t i = ref.begin; i < ref.end; i += LEAF_BLOCK) {
+          size_t n = std::min<size_t>(LEAF_BLOCK, ref.end - i);
+          leaf_squared_distance(_tree.coords, dim, i, n, p, distances);
+          for (size_t l = 0; l < n; ++l) {
+            if (i + l == j) continue;
+            Hit hit(distances[l], i + l);
+            if (_n_hits[j] < _k) {
+              heap[_n_hits[j]++] = hit;
+              std::push_heap(heap, heap + _n_hits[j]);
+            } else if (hit < heap[0]) {
+              std::pop_heap(heap, heap + _k);
+              heap[_k - 1] = hit;
+              std::push_heap(heap, heap + _k);
+            }
+          }
+        }
+      }
+      bound = std::max(bound, kth_distance(j));
+    }
+    _bounds[q] = bound;
+  }
+};
+
+// All pairs of points from two trees within a radius of each other. The join
+// follows the fuzzy semantics of range queries: pairs within r - eps are always
+// reported, pairs farther apart than r + eps never are, and pairs in between
+// may or may not be. Node pairs beyond r - eps are pruned and node pairs
+// within r + eps are reported whole without computing any distances
+template<size_t dim>
+class flat_join {
+public:
+  typedef std::pair<size_t, size_t> Pair;
+
+private:
+  const flat_view<dim>& _a;
+  const flat_view<dim>& _b;
+  double _r2;
+  double _inner2;
+  double _outer2;
+
+public:
+  flat_join(const flat_view<dim>& a, const flat_view<dim>& b, double r, double eps) : _a(a), _b(b), _r2(r * r) {
+    _inner2 = std::max(r - eps, 0.0) * std::max(r - eps, 0.0);
+    _outer2 = (r + eps) * (r + eps);
+  }
+
+  // Subtrees of the first tree are joined with the second tree concurrently,
+  // each writing the pairs it finds, as positions in tree order, to its own
+  // buffer
+  std::vector< std::vector<Pair> > run(size_t threads) const {
+    std::vector< std::vector<Pair> > res;
+    if (_a.size() == 0 || _b.size() == 0) {
+      return res;
+    }
+    std::vector<size_t> roots = flat_subtree_roots(_a.nodes, threads);
+    res.resize(roots.size());
+    parallel_for(roots.size(), threads, [&](size_t i) {
+      traverse(roots[i], 0, res[i]);
+    });
+    return res;
+  }
+
+private:
+  void traverse(size_t i, size_t j, std::vector<Pair>& res) const {
+    const flat_node& a = _a.nodes[i];
+    const flat_node& b = _b.nodes[j];
+    if (flat_empty(a) || flat_empty(b) || flat_min_distance<dim>(a, b) > _inner2) {
+      return;
+    }
+    if (flat_max_distance<dim>(a, b) <= _outer2) {
+      for (size_t k = a.begin; k < a.end; ++k) {
+        for (size_t l = b.begin; l < b.end; ++l) {
+          res.emplace_back(k, l);
+        }
+      }
+      return;
+    }
+    if (a.is_leaf() && b.is_leaf()) {
+      base_case(a, b, res);
+      return;
+    }
+    // The larger of the two nodes is split, with the first tree split on ties
+    if (b.is_leaf() || (!a.is_leaf() && flat_count(a) >= flat_count(b))) {
+      traverse(i + 1, j, res);
+      traverse(a.upper, j, res);
+    } else {
+      traverse(i, j + 1, res);
+      traverse(i, b.upper, res);
+    }
+  }
+
+  void base_case(const flat_node& a, const flat_node& b, std::vector<Pair>& res) const {
+    double p[dim];
+    double distances[LEAF_BLOCK];
+    for (size_t k = a.begin; k < a.end; ++k) {
+      for (size_t d = 0; d < dim; ++d) p[d] = _a.coords[d][k];
+      if (flat_min_distance<dim>(p, b) > _inner2) continue;
+      for (size_t l = b.begin; l < b.end; l += LEAF_BLOCK) {
+        size_t n = std::min<size_t>(LEAF_BLOCK, b.end - l);
+        leaf_squared_distance(_b.coords, dim, l, n, p, distances);
+        for (size_t m = 0; m < n; ++m) {
+          if (distances[m] <= _r2) {
+            res.emplace_back(k, l + m);
+          }
+        }
+      }
+    }
+  }
+};
@@ -3,8 +3,7 @@
 #include "tree.h"
 #include <CGAL/Splitters.h>
 
-class fair_tree_2 : public tree<CGAL::Fair<CGAL::Search_traits_2<Kernel> >, 2> {
-  typedef CGAL::Fair<CGAL::Search_traits_2<Kernel> > Splitter;
+class fair_tree_2 : public tree<CGAL::Fair, 2> {
 public:
   using tree::tree;
   ~fair_tree_2() = default;
@@ -18,8 +17,7 @@ protected:
 };
 typedef cpp11::external_pointer<fair_tree_2> fair_tree_2_p;
 
-class fair_tree_3 : public tree<CGAL::Fair<CGAL::Search_traits_3<Kernel> >, 3> {
-  typedef CGAL::Fair<CGAL::Search_traits_3<Kernel> > Splitter;
+class fair_tree_3 : public tree<CGAL::Fair, 3> {
 public:
   using tree::tree;
   ~fair_tree_3() = default;
@@ -32,3 +30,31 @@ protected:
   }
 };
 typedef cpp11::external_pointer<fair_tree_3> fair_tree_3_p;
+
+class fair_tree_2_double : public tree<CGAL::Fair, 2, Double_kernel> {
+public:
+  using tree::tree;
+  ~fair_tree_2_double() = default;
+
+  std::string split_type() const { return "fair"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket, aspect);
+  }
+};
+typedef cpp11::external_pointer<fair_tree_2_double> fair_tree_2_double_p;
+
+class fair_tree_3_double : public tree<CGAL::Fair, 3, Double_kernel> {
+public:
+  using tree::tree;
+  ~fair_tree_3_double() = default;
+
+  std::string split_type() const { return "fair"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket, aspect);
+  }
+};
+typedef cpp11::external_pointer<fair_tree_3_double> fair_tree_3_double_p;
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// The flat layout stores a built kd tree in a single contiguous block of
+// memory that can be written to disk as is and memory mapped back in. The block
+// consists of a header, the nodes in depth-first order, the input index of each
+// point in tree order, and the point coordinates in tree order. Coordinates are
+// stored as one array per dimension so that the coordinates of the points in a
+// leaf are packed together for each dimension. Weighted trees follow these with
+// the weight of each point in tree order and a summary of the weights below
+// each node.
+
+static const char FLAT_MAGIC[8] = {'O', 'R', 'I', 'O', 'N', 'K', 'D', '\0'};
+static const uint32_t FLAT_VERSION = 1;
+static const uint32_t FLAT_WEIGHTED = 1;
+static const uint32_t FLAT_ENDIAN = 0x01020304;
+
+struct flat_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint32_t dim;
+  uint32_t flags;
+  uint64_t n_points;
+  uint64_t n_nodes;
+  // Points removed before flattening leave gaps in the input index, so this is
+  // one past the largest index rather than the number of points
+  uint64_t n_input;
+  uint64_t bucket;
+  double aspect;
+  char split_type[32];
+};
+
+// The lower child of an internal node is always stored directly after it. The
+// points of a subtree are stored contiguously in [begin, end)
+struct flat_node {
+  uint64_t begin;
+  uint64_t end;
+  uint64_t upper;
+  double cut_value;
+  int32_t cut_dim;
+  int32_t padding;
+  double low[3];
+  double high[3];
+
+  bool is_leaf() const { return cut_dim < 0; }
+};
+
+inline size_t flat_nodes_offset() {
+  return sizeof(flat_header);
+}
+inline size_t flat_index_offset(uint64_t n_nodes) {
+  return flat_nodes_offset() + n_nodes * sizeof(flat_node);
+}
+inline size_t flat_coords_offset(uint64_t n_nodes, uint64_t n_points) {
+  return flat_index_offset(n_nodes) + n_points * sizeof(uint64_t);
+}
+// The weights of the points below a node. The number of points is given by the
+// point range of the node
+struct flat_summary {
+  double sum;
+  double min;
+  double max;
+};
+
+inline size_t flat_weights_offset(uint32_t dim, uint64_t n_nodes, uint64_t n_points) {
+  return flat_coords_offset(n_nodes, n_points) + n_points * dim * sizeof(double);
+}
+inline size_t flat_summaries_offset(uint32_t dim, uint64_t n_nodes, uint64_t n_points) {
+  return flat_weights_offset(dim, n_nodes, n_points) + n_points * sizeof(double);
+}
+inline size_t flat_size(uint32_t dim, uint64_t n_nodes, uint64_t n_points, bool weighted) {
+  if (!weighted) {
+    return flat_weights_offset(dim, n_nodes, n_points);
+  }
+  return flat_summaries_offset(dim, n_nodes, n_points) + n_nodes * sizeof(flat_summary);
+}
+// The same as flat_size() but returns false instead of wrapping around if the
+// size can't be represented, as happens with the counts of a corrupt header
+inline bool flat_size_checked(uint32_t dim, uint64_t n_nodes, uint64_t n_points, bool weighted, size_t& size) {
+  const size_t max = std::numeric_limits<size_t>::max();
+  size_t node_size = sizeof(flat_node) + (weighted ? sizeof(flat_summary) : 0);
+  size_t point_size = sizeof(uint64_t) + dim * sizeof(double) + (weighted ? sizeof(double) : 0);
+  if (n_nodes > max / node_size || n_points > max / point_size) {
+    return false;
+  }
+  size_t nodes = n_nodes * node_size;
+  size_t points = n_points * point_size;
+  if (nodes > max - sizeof(flat_header) || points > max - sizeof(flat_header) - nodes) {
+    return false;
+  }
+  size = sizeof(flat_header) + nodes + points;
+  return true;
+}
+
+// Incrementally constructs the flat layout from a depth-first walk of a tree
+class flat_builder {
+  uint32_t _dim;
+  std::string _split_type;
+  size_t _bucket;
+  double _aspect;
+  std::vector<flat_node> _nodes;
+  std::vector<uint64_t> _index;
+  std::vector<double> _coords;
+  bool _weighted;
+  std::vector<double> _weights;
+
+public:
+  flat_builder(uint32_t dim, std::string split_type, size_t bucket, double aspect, bool weighted = false) :
+    _dim(dim), _split_type(split_type), _bucket(bucket), _aspect(aspect), _weighted(weighted) {}
+
+  size_t add_internal(int cut_dim, double cut_value) {
+    flat_node node = {};
+    node.cut_dim = cut_dim;
+    node.cut_value = cut_value;
+    _nodes.push_back(node);
+    return _nodes.size() - 1;
+  }
+  size_t add_leaf() {
+    flat_node node = {};
+    node.cut_dim = -1;
+    node.begin = _index.size();
+    node.end = _index.size();
+    _nodes.push_back(node);
+    return _nodes.size() - 1;
+  }
+  void set_upper(size_t node, size_t upper) {
+    _nodes[node].upper = upper;
+  }
+  // Points must be added directly after the leaf they belong to
+  void add_point(uint64_t index, const double* coords, double weight = 1.0) {
+    _index.push_back(index);
+    _coords.insert(_coords.end(), coords, coords + _dim);
+    if (_weighted) _weights.push_back(weight);
+    _nodes.back().end = _index.size();
+  }
+
+  // Computes the point range, bounding box, and weight summary of every node
+  // bottom-up
+  std::vector<char> finish() {
+    if (_nodes.empty()) {
+      add_leaf();
+    }
+    std::vector<flat_summary> summaries(_weighted ? _nodes.size() : 0);
+    for (size_t i = _nodes.size(); i-- > 0;) {
+      flat_node& node = _nodes[i];
+      for (size_t d = 0; d < 3; ++d) {
+        node.low[d] = std::numeric_limits<double>::infinity();
+        node.high[d] = -std::numeric_limits<double>::infinity();
+      }
+      if (node.is_leaf()) {
+        for (uint64_t j = node.begin; j < node.end; ++j) {
+          for (size_t d = 0; d < _dim; ++d) {
+            node.low[d] = std::min(node.low[d], _coords[j * _dim + d]);
+            node.high[d] = std::max(node.high[d], _coords[j * _dim + d]);
+          }
+        }
+        if (_weighted) {
+          flat_summary& summary = summaries[i];
+          summary.sum = 0.0;
+          summary.min = std::numeric_limits<double>::infinity();
+          summary.max = -std::numeric_limits<double>::infinity();
+          for (uint64_t j = node.begin; j < node.end; ++j) {
+            summary.sum += _weights[j];
+            summary.min = std::min(summary.min, _weights[j]);
+            summary.max = std::max(summary.max, _weights[j]);
+          }
+        }
+      } else {
+        const flat_node& lower = _nodes[i + 1];
+        const flat_node& upper = _nodes[node.upper];
+        node.begin = lower.begin;
+        node.end = upper.end;
+        for (size_t d = 0; d < _dim; ++d) {
+          node.low[d] = std::min(lower.low[d], upper.low[d]);
+          node.high[d] = std::max(lower.high[d], upper.high[d]);
+        }
+        if (_weighted) {
+          summaries[i].sum = summaries[i + 1].sum + summaries[node.upper].sum;
+          summaries[i].min = std::min(summaries[i + 1].min, summaries[node.upper].min);
+          summaries[i].max = std::max(summaries[i + 1].max, summaries[node.upper].max);
+        }
+      }
+    }
+
+    std::vector<char> image(flat_size(_dim, _nodes.size(), _index.size(), _weighted));
+    flat_header header = {};
+    std::memcpy(header.magic, FLAT_MAGIC, sizeof(FLAT_MAGIC));
+    header.version = FLAT_VERSION;
+    header.endian = FLAT_ENDIAN;
+    header.dim = _dim;
+    header.flags = _weighted ? FLAT_WEIGHTED : 0;
+    header.n_points = _index.size();
+    header.n_nodes = _nodes.size();
+    for (auto iter = _index.begin(); iter != _index.end(); iter++) {
+      header.n_input = std::max(header.n_input, *iter + 1);
+    }
+    header.bucket = _bucket;
+    header.aspect = _aspect;
+    std::strncpy(header.split_type, _split_type.c_str(), sizeof(header.split_type) - 1);
+    std::memcpy(image.data(), &header, sizeof(flat_header));
+    std::memcpy(image.data() + flat_nodes_offset(), _nodes.data(), _nodes.size() * sizeof(flat_node));
+    std::memcpy(image.data() + flat_index_offset(_nodes.size()), _index.data(), _index.size() * sizeof(uint64_t));
+    double* coords = reinterpret_cast<double*>(image.data() + flat_coords_offset(_nodes.size(), _index.size()));
+    size_t n = _index.size();
+    for (size_t j = 0; j < n; ++j) {
+      for (size_t d = 0; d < _dim; ++d) {
+        coords[d * n + j] = _coords[j * _dim + d];
+      }
+    }
+    if (_weighted) {
+      std::memcpy(image.data() + flat_weights_offset(_dim, _nodes.size(), n), _weights.data(), n * sizeof(double));
+      std::memcpy(image.data() + flat_summaries_offset(_dim, _nodes.size(), n), summaries.data(), summaries.size() * sizeof(flat_summary));
+    }
+    return image;
+  }
+};
+
+// The header of an image built in this process by flat_builder, which needs no
+// validation
+inline const flat_header* flat_image_header(const char* data) {
+  return reinterpret_cast<const flat_header*>(data);
+}
+
+// Checks that a block of memory holds a valid flat tree and returns its header.
+// Besides the header, the structure of the nodes is checked so that traversals
+// of a corrupt file can't read outside of it or loop forever: point ranges must
+// lie within the points and the children of a node must come after it
+inline const flat_header* validate_flat_image(const char* data, size_t size) {
+  if (size < sizeof(flat_header)) {
+    throw std::runtime_error("File is too small to contain a kd tree");
+  }
+  const flat_header* header = reinterpret_cast<const flat_header*>(data);
+  if (std::memcmp(header->magic, FLAT_MAGIC, sizeof(FLAT_MAGIC)) != 0) {
+    throw std::runtime_error("File does not contain a kd tree");
+  }
+  if (header->endian != FLAT_ENDIAN) {
+    throw std::runtime_error("kd tree file was written on a machine with a different byte order");
+  }
+  if (header->version != FLAT_VERSION) {
+    throw std::runtime_error("kd tree file was written with an incompatible version of orion");
+  }
+  if (header->dim != 2 && header->dim != 3) {
+    throw std::runtime_error("kd tree file has an unsupported dimensionality");
+  }
+  size_t expected;
+  if (!flat_size_checked(header->dim, header->n_nodes, header->n_points, header->flags & FLAT_WEIGHTED, expected) || size != expected) {
+    throw std::runtime_error("kd tree file is truncated or corrupt");
+  }
+  // Indices are returned to R as integers
+  if (header->n_nodes == 0 || header->n_points > header->n_input || header->n_input > uint64_t(std::numeric_limits<int>::max())) {
+    throw std::runtime_error("kd tree file is corrupt");
+  }
+  const flat_node* nodes = reinterpret_cast<const flat_node*>(data + flat_nodes_offset());
+  for (uint64_t i = 0; i < header->n_nodes; ++i) {
+    const flat_node& node = nodes[i];
+    if (node.begin > node.end || node.end > header->n_points) {
+      throw std::runtime_error("kd tree file is corrupt");
+    }
+    if (node.is_leaf()) continue;
+    if (node.cut_dim >= int32_t(header->dim) || i + 1 >= header->n_nodes || node.upper <= i + 1 || node.upper >= header->n_nodes) {
+      throw std::runtime_error("kd tree file is corrupt");
+    }
+  }
+  const uint64_t* index = reinterpret_cast<const uint64_t*>(data + flat_index_offset(header->n_nodes));
+  for (uint64_t j = 0; j < header->n_points; ++j) {
+    if (index[j] >= header->n_input) {
+      throw std::runtime_error("kd tree file is corrupt");
+    }
+  }
+  return header;
+}
+
+// The image is written to a temporary file that is then moved into place so that
+// a file currently mapped by a loaded tree is never truncated under it
+inline void write_flat_image(const std::string& path, const char* data, size_t size) {
+  std::string tmp = path + ".tmp";
+  {
+    std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+    if (!file) {
+      throw std::runtime_error("Unable to open file for writing");
+    }
+    file.write(data, size);
+    if (!file) {
+      std::remove(tmp.c_str());
+      throw std::runtime_error("Failed to write kd tree to file");
+    }
+  }
+  if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+    // Renaming onto an existing file is not allowed on all platforms
+    std::remove(path.c_str());
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      throw std::runtime_error("Failed to write kd tree to file");
+    }
+  }
+}
@@ -0,0 +1,848 @@
+#pragma once
+
+#include "tree.h"
+#include "flat_layout.h"
+#include "mapped_file.h"
+#include "leaf_scan.h"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+
+// Points are stored as plain coordinates in the flat layout
+inline Double_kernel::Point_2 flat_point(const double* p, std::integral_constant<size_t, 2>) {
+  return Double_kernel::Point_2(p[0], p[1]);
+}
+inline Double_kernel::Point_3 flat_point(const double* p, std::integral_constant<size_t, 3>) {
+  return Double_kernel::Point_3(p[0], p[1], p[2]);
+}
+
+// Distances between queries and points or node bounds. The distances are the
+// transformed distances reported by the corresponding CGAL distance classes so
+// that a flat tree gives the same results as the tree it was saved from. Point
+// distances are computed for a block of leaf points at a time with the kernels
+// from leaf_scan.h
+template<size_t dim, typename Metric = l2_metric>
+struct flat_point_distance {
+  Metric metric;
+  double q[dim];
+
+  flat_point_distance(const typename std::conditional<dim == 2, Double_kernel::Point_2, Double_kernel::Point_3>::type& query, const Metric& metric = Metric()) : metric(metric) {
+    for (size_t d = 0; d < dim; ++d) q[d] = query.cartesian(d);
+  }
+  void leaf(const double* const* coords, size_t begin, size_t n, double* out) const {
+    leaf_impl(coords, begin, n, out, metric);
+  }
+  double min_node(const flat_node& node) const {
+    double res = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+      double diff = std::max(std::max(node.low[d] - q[d], q[d] - node.high[d]), 0.0);
+      res = metric.combine(res, metric.term(diff, d));
+    }
+    return res;
+  }
+  double max_node(const flat_node& node) const {
+    double res = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+      double diff = std::max(std::abs(q[d] - node.low[d]), std::abs(q[d] - node.high[d]));
+      res = metric.combine(res, metric.term(diff, d));
+    }
+    return res;
+  }
+  double transform(double d) const { return metric.transform(d); }
+  double bound(double d) const { return metric.transform(d); }
+
+private:
+  void leaf_impl(const double* const* coords, size_t begin, size_t n, double* out, const l2_metric&) const {
+    leaf_squared_distance(coords, dim, begin, n, q, out);
+  }
+  template<typename M>
+  void leaf_impl(const double* const* coords, size_t begin, size_t n, double* out, const M&) const {
+    for (size_t i = 0; i < n; ++i) {
+      double res = 0.0;
+      for (size_t d = 0; d < dim; ++d) {
+        res = metric.combine(res, metric.term(q[d] - coords[d][begin + i], d));
+      }
+      out[i] = res;
+    }
+  }
+};
+
+template<size_t dim>
+struct flat_spheroid_distance {
+  flat_point_distance<dim> center;
+  double r2;
+
+  flat_spheroid_distance(const typename std::conditional<dim == 2, Double_kernel::Circle_2, Double_kernel::Sphere_3>::type& query) :
+    center(query.center()), r2(query.squared_radius()) {}
+  void leaf(const double* const* coords, size_t begin, size_t n, double* out) const {
+    center.leaf(coords, begin, n, out);
+    for (size_t i = 0; i < n; ++i) out[i] = std::max(out[i] - r2, 0.0);
+  }
+  double min_node(const flat_node& node) const {
+    return std::max(center.min_node(node) - r2, 0.0);
+  }
+  double max_node(const flat_node& node) const {
+    return center.max_node(node) - r2;
+  }
+  double transform(double d) const { return d * d; }
+  // A point at most d outside the spheroid has a distance of at most
+  // (r + d)^2 - r^2
+  double bound(double d) const { return d * (d + 2.0 * std::sqrt(r2)); }
+};
+
+template<size_t dim>
+struct flat_box_distance {
+  double low[dim];
+  double high[dim];
+
+  flat_box_distance(const typename std::conditional<dim == 2, Double_kernel::Iso_rectangle_2, Double_kernel::Iso_cuboid_3>::type& query) {
+    for (size_t d = 0; d < dim; ++d) {
+      low[d] = query.min().cartesian(d);
+      high[d] = query.max().cartesian(d);
+    }
+  }
+  void leaf(const double* const* coords, size_t begin, size_t n, double* out) const {
+    leaf_box_distance(coords, dim, begin, n, low, high, out);
+  }
+  double min_node(const flat_node& node) const {
+    double res = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+      res += std::max(std::max(low[d] - node.high[d], node.low[d] - high[d]), 0.0);
+    }
+    return res;
+  }
+  double max_node(const flat_node& node) const {
+    double res = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+      res += std::max(high[d] - node.low[d], node.high[d] - low[d]);
+    }
+    return res;
+  }
+  double transform(double d) const { return d; }
+  double bound(double d) const { return d; }
+};
+
+// Range queries follow the fuzzy semantics of CGAL: points within the range
+// shrunk by eps are always reported, points outside the range grown by eps are
+// never reported, and points in between may or may not be. Leaf points are
+// tested by computing their distance to the range and passing it to contains()
+template<size_t dim>
+struct flat_spheroid_range {
+  flat_point_distance<dim> center;
+  double r2;
+  double inner2;
+  double outer2;
+
+  flat_spheroid_range(const typename std::conditional<dim == 2, Double_kernel::Circle_2, Double_kernel::Sphere_3>::type& query, double eps) :
+    center(query.center()), r2(query.squared_radius()) {
+    double r = std::sqrt(r2);
+    inner2 = std::max(r - eps, 0.0) * std::max(r - eps, 0.0);
+    outer2 = (r + eps) * (r + eps);
+  }
+  void leaf(const double* const* coords, size_t begin, size_t n, double* out) const {
+    center.leaf(coords, begin, n, out);
+  }
+  bool contains(double distance) const {
+    return distance <= r2;
+  }
+  bool inner_intersects(const flat_node& node) const {
+    return center.min_node(node) <= inner2;
+  }
+  bool outer_contains(const flat_node& node) const {
+    return center.max_node(node) <= outer2;
+  }
+};
+
+template<size_t dim>
+struct flat_box_range {
+  double low[dim];
+  double high[dim];
+  double eps;
+
+  flat_box_range(const typename std::conditional<dim == 2, Double_kernel::Iso_rectangle_2, Double_kernel::Iso_cuboid_3>::type& query, double eps) : eps(eps) {
+    for (size_t d = 0; d < dim; ++d) {
+      low[d] = query.min().cartesian(d);
+      high[d] = query.max().cartesian(d);
+    }
+  }
+  void leaf(const double* const* coords, size_t begin, size_t n, double* out) const {
+    leaf_box_distance(coords, dim, begin, n, low, high, out);
+  }
+  bool contains(double distance) const {
+    return distance <= 0.0;
+  }
+  bool inner_intersects(const flat_node& node) const {
+    for (size_t d = 0; d < dim; ++d) {
+      if (node.high[d] < low[d] + eps || node.low[d] > high[d] - eps) return false;
+    }
+    return true;
+  }
+  bool outer_contains(const flat_node& node) const {
+    for (size_t d = 0; d < dim; ++d) {
+      if (node.low[d] < low[d] - eps || node.high[d] > high[d] + eps) return false;
+    }
+    return true;
+  }
+};
+
+// A kd tree stored in the flat layout. The layout is either held in memory,
+// when the tree is created with the flat engine, or read directly from a memory
+// mapped file so loading is independent of the size of the tree and the pages
+// are shared between processes using the same file. Nodes are visited in the
+// order they are stored and leaf scans read each dimension from its own array.
+// Flat trees always use double precision
+template<size_t dim>
+class flat_tree : public tree_base {
+  typedef typename std::conditional<dim == 2, Double_kernel::Point_2, Double_kernel::Point_3>::type Point;
+  typedef typename std::conditional<dim == 2, Double_kernel::Circle_2, Double_kernel::Sphere_3>::type Spheroid;
+  typedef typename std::conditional<dim == 2, Double_kernel::Iso_rectangle_2, Double_kernel::Iso_cuboid_3>::type Box;
+  typedef typename std::conditional<dim == 2, Point_2, Point_3>::type Exact_point;
+  typedef std::pair<double, size_t> Hit;
+
+  std::vector<char> _image;
+  std::unique_ptr<mapped_file> _file;
+  const char* _data;
+  size_t _size;
+  const flat_header* _header;
+  const flat_node* _nodes;
+  const uint64_t* _index;
+  const double* _coords[dim];
+  // Null for unweighted trees
+  const double* _weights;
+  const flat_summary* _summaries;
+
+public:
+  flat_tree(std::unique_ptr<mapped_file> file) : _file(std::move(file)) {
+    attach(_file->data(), _file->size());
+  }
+  flat_tree(std::vector<char> image) : _image(std::move(image)) {
+    attach(_image.data(), _image.size());
+  }
+  ~flat_tree() = default;
+
+  size_t dimension() const { return dim; }
+  std::string split_type() const { return _header->split_type; }
+  std::string precision() const { return "double"; }
+  size_t bucket_size() const { return _header->bucket; }
+  double aspect_ratio() const { return _header->aspect; }
+  std::string engine() const { return "flat"; }
+  bool weighted() const { return _weights != nullptr; }
+
+  size_t size() const { return _header->n_points; }
+  // Indices may have gaps if points were removed before the tree was saved so
+  // points are ordered by sorting on their index
+  SEXP points() const {
+    std::vector< std::pair<uint64_t, size_t> > order;
+    order.reserve(size());
+    for (size_t j = 0; j < size(); ++j) {
+      order.emplace_back(_index[j], j);
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<Exact_point> res;
+    res.reserve(size());
+    for (auto iter = order.begin(); iter != order.end(); iter++) {
+      res.push_back(point_at(iter->second));
+    }
+    return create_euclid_vec(res);
+  }
+  SEXP bbox() const {
+    const flat_node& root = _nodes[0];
+    if (dim == 2) {
+      std::vector<Iso_rectangle> ir;
+      ir.emplace_back(Point_2(Exact_number(root.low[0]), Exact_number(root.low[1])),
+                      Point_2(Exact_number(root.high[0]), Exact_number(root.high[1])));
+      return create_euclid_vec(ir);
+    } else {
+      std::vector<Iso_cuboid> ic;
+      ic.emplace_back(Point_3(Exact_number(root.low[0]), Exact_number(root.low[1]), Exact_number(root.low[2])),
+                      Point_3(Exact_number(root.high[0]), Exact_number(root.high[1]), Exact_number(root.high[2])));
+      return create_euclid_vec(ic);
+    }
+  }
+
+  cpp11::writable::list shape() const {
+    size_t depth = 0;
+    size_t n_internal = 0;
+    double depth_sum = 0.0;
+    std::vector<int> occupancy;
+    std::vector< std::pair<size_t, size_t> > stack;
+    stack.emplace_back(0, 0);
+    while (!stack.empty()) {
+      std::pair<size_t, size_t> next = stack.back();
+      stack.pop_back();
+      const flat_node& node = _nodes[next.first];
+      if (node.is_leaf()) {
+        size_t n = node.end - node.begin;
+        if (occupancy.size() <= n) occupancy.resize(n + 1, 0);
+        occupancy[n]++;
+        depth = std::max(depth, next.second);
+        depth_sum += next.second;
+      } else {
+        n_internal++;
+        stack.emplace_back(next.first + 1, next.second + 1);
+        stack.emplace_back(node.upper, next.second + 1);
+      }
+    }
+    size_t n_leaves = _header->n_nodes - n_internal;
+    return assemble_shape(depth, depth_sum / n_leaves, n_internal, occupancy, _size);
+  }
+
+  cpp11::writable::list point_search(SEXP points, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder, std::string metric, double p, cpp11::doubles weights) const {
+    std::vector<Point> pts = get_query_vec<Point>(points);
+    std::vector<double> w(weights.begin(), weights.end());
+    return dispatch_metric(metric, p, w, dim, [&](auto m) {
+      return search_impl(pts, [&m](const Point& q) { return flat_point_distance<dim, decltype(m)>(q, m); }, n, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
+    });
+  }
+  cpp11::writable::list spheroid_search(SEXP spheroids, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    return search_impl(sph, [](const Spheroid& q) { return flat_spheroid_distance<dim>(q); }, n, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
+  }
+  cpp11::writable::list box_search(SEXP boxes, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    return search_impl(box, [](const Box& q) { return flat_box_distance<dim>(q); }, n, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
+  }
+
+  cpp11::writable::list spheroid_range(SEXP spheroids, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    return range_impl<flat_spheroid_range<dim> >(sph, eps, index, stats, threads, reorder, unique);
+  }
+  cpp11::writable::list box_range(SEXP boxes, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    return range_impl<flat_box_range<dim> >(box, eps, index, stats, threads, reorder, unique);
+  }
+
+  SEXP spheroid_count(SEXP spheroids, SEXP eps, bool any, int threads) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    return count_impl<flat_spheroid_range<dim> >(sph, eps, any, threads);
+  }
+  SEXP box_count(SEXP boxes, SEXP eps, bool any, int threads) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    return count_impl<flat_box_range<dim> >(box, eps, any, threads);
+  }
+
+  SEXP spheroid_aggregate(SEXP spheroids, SEXP eps, int threads) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    return aggregate_impl<flat_spheroid_range<dim> >(sph, eps, threads);
+  }
+  SEXP box_aggregate(SEXP boxes, SEXP eps, int threads) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    return aggregate_impl<flat_box_range<dim> >(box, eps, threads);
+  }
+
+  neighbor_cursor* cursor(SEXP point, bool nearest) const {
+    std::vector<Point> pts = get_query_vec<Point>(point);
+    if (pts.size() != 1) {
+      cpp11::stop("A cursor must start from a single point");
+    }
+    return new best_first_cursor(this, pts[0], nearest);
+  }
+
+  cpp11::writable::integers insert(SEXP points, cpp11::doubles weights) {
+    cpp11::stop("Flat trees can't be modified");
+  }
+  void remove(cpp11::integers index) {
+    cpp11::stop("Flat trees can't be modified");
+  }
+  void set_weights(cpp11::doubles weights) {
+    cpp11::stop("Flat trees can't be modified");
+  }
+
+  std::vector<char> flatten() {
+    return std::vector<char>(_data, _data + _size);
+  }
+  flat_image_ref flat_image() {
+    flat_image_ref res;
+    res.borrowed = _data;
+    res.borrowed_size = _size;
+    return res;
+  }
+  void save(const std::string& file) {
+    write_flat_image(file, _data, _size);
+  }
+
+private:
+  // Saved images have been validated by load_flat_tree() before they get here
+  void attach(const char* data, size_t size) {
+    _data = data;
+    _size = size;
+    _header = flat_image_header(data);
+    _nodes = reinterpret_cast<const flat_node*>(data + flat_nodes_offset());
+    _index = reinterpret_cast<const uint64_t*>(data + flat_index_offset(_header->n_nodes));
+    const double* coords = reinterpret_cast<const double*>(data + flat_coords_offset(_header->n_nodes, _header->n_points));
+    for (size_t d = 0; d < dim; ++d) {
+      _coords[d] = coords + d * _header->n_points;
+    }
+    if (_header->flags & FLAT_WEIGHTED) {
+      _weights = reinterpret_cast<const double*>(data + flat_weights_offset(dim, _header->n_nodes, _header->n_points));
+      _summaries = reinterpret_cast<const flat_summary*>(data + flat_summaries_offset(dim, _header->n_nodes, _header->n_points));
+    } else {
+      _weights = nullptr;
+      _summaries = nullptr;
+    }
+  }
+  void coords_at(size_t j, double* p) const {
+    for (size_t d = 0; d < dim; ++d) p[d] = _coords[d][j];
+  }
+  Exact_point point_at(size_t j) const {
+    double p[dim];
+    coords_at(j, p);
+    return to_exact_kernel(flat_point(p, std::integral_constant<size_t, dim>()));
+  }
+
+  // Traversals always record stats as the counters are cheap compared to the
+  // work they count
+  template<typename R>
+  void range_node(size_t i, const R& range, std::vector<size_t>& res, query_stats& stats) const {
+    const flat_node& node = _nodes[i];
+    if (node.begin == node.end || !range.inner_intersects(node)) {
+      return;
+    }
+    stats.nodes++;
+    if (range.outer_contains(node)) {
+      for (size_t j = node.begin; j < node.end; ++j) {
+        res.push_back(j);
+      }
+      return;
+    }
+    if (node.is_leaf()) {
+      stats.leaves++;
+      stats.distances += node.end - node.begin;
+      double distances[LEAF_BLOCK];
+      for (size_t j = node.begin; j < node.end; j += LEAF_BLOCK) {
+        size_t n = std::min<size_t>(LEAF_BLOCK, node.end - j);
+        range.leaf(_coords, j, n, distances);
+        for (size_t l = 0; l < n; ++l) {
+          if (range.contains(distances[l])) {
+            res.push_back(j + l);
+          }
+        }
+      }
+      return;
+    }
+    range_node(i + 1, range, res, stats);
+    range_node(node.upper, range, res, stats);
+  }
+
+  // Marks kept by a chunk of queries in a union range search. A point is only
+  // reported by the first query finding it and nodes whose points are all
+  // marked are skipped by later queries
+  struct union_marks {
+    std::vector<bool> points;
+    std::vector<bool> nodes;
+  };
+  // Returns whether all points below the node are marked
+  template<typename R>
+  bool union_node(size_t i, const R& range, union_marks& marks, std::vector<size_t>& res, query_stats& stats) const {
+    const flat_node& node = _nodes[i];
+    if (marks.nodes[i] || node.begin == node.end) {
+      return true;
+    }
+    if (!range.inner_intersects(node)) {
+      return false;
+    }
+    stats.nodes++;
+    bool full = true;
+    if (range.outer_contains(node)) {
+      for (size_t j = node.begin; j < node.end; ++j) {
+        if (marks.points[j]) continue;
+        marks.points[j] = true;
+        res.push_back(j);
+      }
+    } else if (node.is_leaf()) {
+      stats.leaves++;
+      stats.distances += node.end - node.begin;
+      double distances[LEAF_BLOCK];
+      for (size_t j = node.begin; j < node.end; j += LEAF_BLOCK) {
+        size_t n = std::min<size_t>(LEAF_BLOCK, node.end - j);
+        range.leaf(_coords, j, n, distances);
+        for (size_t l = 0; l < n; ++l) {
+          if (marks.points[j + l]) continue;
+          if (range.contains(distances[l])) {
+            marks.points[j + l] = true;
+            res.push_back(j + l);
+          } else {
+            full = false;
+          }
+        }
+      }
+    } else {
+      bool lower_full = union_node(i + 1, range, marks, res, stats);
+      bool upper_full = union_node(node.upper, range, marks, res, stats);
+      full = lower_full && upper_full;
+    }
+    marks.nodes[i] = full;
+    return full;
+  }
+
+  // Subtrees fully inside the range are aggregated from their cached summary
+  // without visiting their leaves. Unweighted points have a weight of 1
+  template<typename R>
+  void aggregate_node(size_t i, const R& range, weight_summary& res) const {
+    const flat_node& node = _nodes[i];
+    if (node.begin == node.end || !range.inner_intersects(node)) {
+      return;
+    }
+    if (range.outer_contains(node)) {
+      weight_summary summary;
+      summary.count = node.end - node.begin;
+      if (_summaries == nullptr) {
+        summary.sum = summary.count;
+        summary.min = 1.0;
+        summary.max = 1.0;
+      } else {
+        summary.sum = _summaries[i].sum;
+        summary.min = _summaries[i].min;
+        summary.max = _summaries[i].max;
+      }
+      res.add(summary);
+      return;
+    }
+    if (node.is_leaf()) {
+      double distances[LEAF_BLOCK];
+      for (size_t j = node.begin; j < node.end; j += LEAF_BLOCK) {
+        size_t n = std::min<size_t>(LEAF_BLOCK, node.end - j);
+        range.leaf(_coords, j, n, distances);
+        for (size_t l = 0; l < n; ++l) {
+          if (range.contains(distances[l])) {
+            res.add(_weights == nullptr ? 1.0 : _weights[j + l]);
+          }
+        }
+      }
+      return;
+    }
+    aggregate_node(i + 1, range, res);
+    aggregate_node(node.upper, range, res);
+  }
+
+  // Subtrees fully inside the range are counted from their point range without
+  // visiting their leaves
+  template<typename R>
+  size_t count_node(size_t i, const R& range, bool any) const {
+    const flat_node& node = _nodes[i];
+    if (node.begin == node.end || !range.inner_intersects(node)) {
+      return 0;
+    }
+    if (range.outer_contains(node)) {
+      return node.end - node.begin;
+    }
+    size_t n = 0;
+    if (node.is_leaf()) {
+      double distances[LEAF_BLOCK];
+      for (size_t j = node.begin; j < node.end; j += LEAF_BLOCK) {
+        size_t m = std::min<size_t>(LEAF_BLOCK, node.end - j);
+        range.leaf(_coords, j, m, distances);
+        for (size_t l = 0; l < m; ++l) {
+          if (range.contains(distances[l])) {
+            n++;
+            if (any) return n;
+          }
+        }
+      }
+      return n;
+    }
+    n += count_node(i + 1, range, any);
+    if (any && n > 0) {
+      return n;
+    }
+    return n + count_node(node.upper, range, any);
+  }
+
+  // The heap is ordered so that its top is always the worst of the current
+  // candidates. Nodes are pruned when they lie beyond the bound or can't
+  // improve on the worst candidate by more than the eps factor, and skipped
+  // once the leaf budget is spent
+  template<typename D, typename C>
+  void knn_node(size_t i, const D& dist, size_t k, double factor, double bound, std::vector<Hit>& heap, C comp, leaf_budget& budget, query_stats& stats) const {
+    if (!budget.available()) {
+      return;
+    }
+    const flat_node& node = _nodes[i];
+    stats.nodes++;
+    if (node.is_leaf()) {
+      stats.leaves++;
+      budget.spend();
+      stats.distances += node.end - node.begin;
+      double distances[LEAF_BLOCK];
+      for (size_t j = node.begin; j < node.end; j += LEAF_BLOCK) {
+        size_t n = std::min<size_t>(LEAF_BLOCK, node.end - j);
+        dist.leaf(_coords, j, n, distances);
+        for (size_t l = 0; l < n; ++l) {
+          if (distances[l] > bound) continue;
+          Hit hit(distances[l], j + l);
+          if (heap.size() < k) {
+            heap.push_back(hit);
+            std::push_heap(heap.begin(), heap.end(), comp);
+          } else if (comp(hit, heap.front())) {
+            std::pop_heap(heap.begin(), heap.end(), comp);
+            heap.back() = hit;
+            std::push_heap(heap.begin(), heap.end(), comp);
+          }
+        }
+      }
+      return;
+    }
+    size_t children[2] = {i + 1, node.upper};
+    double lows[2];
+    double bounds[2];
+    for (size_t c = 0; c < 2; ++c) {
+      lows[c] = dist.min_node(_nodes[children[c]]);
+      bounds[c] = nearest(comp) ? lows[c] : dist.max_node(_nodes[children[c]]);
+    }
+    // Visit the most promising child first
+    if (nearest(comp) ? bounds[1] < bounds[0] : bounds[1] > bounds[0]) {
+      std::swap(children[0], children[1]);
+      std::swap(lows[0], lows[1]);
+      std::swap(bounds[0], bounds[1]);
+    }
+    for (size_t c = 0; c < 2; ++c) {
+      if (_nodes[children[c]].begin == _nodes[children[c]].end || lows[c] > bound) continue;
+      if (heap.size() == k) {
+        if (nearest(comp) ? bounds[c] * factor >= heap.front().first : bounds[c] <= heap.front().first * factor) continue;
+      }
+      knn_node(children[c], dist, k, factor, bound, heap, comp, budget, stats);
+    }
+  }
+  static bool nearest(std::less<Hit>) { return true; }
+  static bool nearest(std::greater<Hit>) { return false; }
+
+  // bound is the largest distance a neighbor may have, in the transformed
+  // space of the distance
+  template<typename D, typename C>
+  void knn(const D& dist, size_t k, double eps, double bound, bool sort, hit_buffer& buffer, int id, C comp, leaf_budget& budget, search_context<double>& context, query_stats& stats) const {
+    std::vector<Hit>& heap = context.heap;
+    heap.clear();
+    if (k == 0 || size() == 0) {
+      return;
+    }
+    knn_node(0, dist, k, dist.transform(1.0 + eps), bound, heap, comp, budget, stats);
+    if (sort) {
+      std::sort_heap(heap.begin(), heap.end(), comp);
+    }
+    for (auto iter = heap.begin(); iter != heap.end(); iter++) {
+      buffer.index.push_back(iter->second);
+      buffer.id.push_back(id);
+      buffer.distance.push_back(iter->first);
+    }
+  }
+
+  template<typename R, typename Q>
+  cpp11::writable::list range_impl(std::vector<Q>& queries, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const {
+    std::vector<double> eps_vec = get_ft_vec<double>(eps);
+    size_t n_threads = query_threads<Double_kernel>(threads);
+    std::vector<chunk> chunks = split_chunks(queries.size(), n_threads);
+    std::vector<hit_buffer> buffers(chunks.size());
+    std::vector<query_stats> stats_vec(queries.size());
+    std::vector<size_t> order = reorder ? morton_order(queries, dim) : std::vector<size_t>();
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      hit_buffer& buffer = buffers[c];
+      union_marks marks;
+      if (unique) {
+        marks.points.resize(size(), false);
+        marks.nodes.resize(_header->n_nodes, false);
+      }
+      for (size_t pos = chunks[c].begin; pos < chunks[c].end; ++pos) {
+        size_t i = order.empty() ? pos : order[pos];
+        R range(queries[i], eps_vec[i % eps_vec.size()]);
+        if (unique) {
+          union_node(0, range, marks, buffer.index, stats_vec[i]);
+        } else {
+          range_node(0, range, buffer.index, stats_vec[i]);
+        }
+        buffer.id.resize(buffer.index.size(), i + 1);
+      }
+    });
+    if (unique) {
+      merge_union_hits(buffers, size(), [this](size_t j) { return _index[j]; });
+    } else if (!order.empty()) {
+      restore_query_order(buffers, queries.size());
+    }
+    cpp11::writable::list res = assemble_result(buffers, index, false, [this](size_t j) { return _index[j]; }, [this](size_t j) { return point_at(j); });
+    if (stats) {
+      res.push_back("stats"_nm = assemble_stats(stats_vec));
+    }
+    return res;
+  }
+
+  template<typename R, typename Q>
+  SEXP count_impl(std::vector<Q>& queries, SEXP eps, bool any, int threads) const {
+    std::vector<double> eps_vec = get_ft_vec<double>(eps);
+    size_t n_threads = query_threads<Double_kernel>(threads);
+    std::vector<chunk> chunks = split_chunks(queries.size(), n_threads);
+    std::vector<size_t> counts(queries.size());
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      for (size_t i = chunks[c].begin; i < chunks[c].end; ++i) {
+        R range(queries[i], eps_vec[i % eps_vec.size()]);
+        counts[i] = count_node(0, range, any);
+      }
+    });
+    return assemble_counts(counts, any);
+  }
+
+  template<typename R, typename Q>
+  SEXP aggregate_impl(std::vector<Q>& queries, SEXP eps, int threads) const {
+    std::vector<double> eps_vec = get_ft_vec<double>(eps);
+    size_t n_threads = query_threads<Double_kernel>(threads);
+    std::vector<chunk> chunks = split_chunks(queries.size(), n_threads);
+    std::vector<weight_summary> aggregates(queries.size());
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      for (size_t i = chunks[c].begin; i < chunks[c].end; ++i) {
+        R range(queries[i], eps_vec[i % eps_vec.size()]);
+        aggregate_node(0, range, aggregates[i]);
+      }
+    });
+    return assemble_aggregates(aggregates);
+  }
+
+  // make_distance creates the distance functor for a query
+  template<typename Q, typename F>
+  cpp11::writable::list search_impl(std::vector<Q>& queries, F make_distance, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const {
+    std::vector<double> eps_vec = get_ft_vec<double>(eps);
+    std::vector<int> n_vec(n.begin(), n.end());
+    std::vector<double> bound_vec(max_distance.begin(), max_distance.end());
+    std::vector<double> leaves_vec(max_leaves.begin(), max_leaves.end());
+    bool budgeted = std::any_of(leaves_vec.begin(), leaves_vec.end(), [](double l) { return !std::isinf(l); });
+    size_t n_threads = query_threads<Double_kernel>(threads);
+    std::vector<chunk> chunks = split_chunks(queries.size(), n_threads);
+    std::vector<hit_buffer> buffers(chunks.size());
+    std::vector<query_stats> stats_vec(queries.size());
+    std::vector<char> exact_vec(budgeted ? queries.size() : 0, true);
+    std::vector<size_t> order = reorder ? morton_order(queries, dim) : std::vector<size_t>();
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      hit_buffer& buffer = buffers[c];
+      search_context<double> context;
+      for (size_t pos = chunks[c].begin; pos < chunks[c].end; ++pos) {
+        size_t i = order.empty() ? pos : order[pos];
+        auto dist = make_distance(queries[i]);
+        size_t k = std::max(n_vec[i % n_vec.size()], 0);
+        double e = eps_vec[i % eps_vec.size()];
+        // The maximum distance is given in the units of the coordinates. An
+        // infinite bound stays infinite when converted
+        double bound = dist.bound(bound_vec[i % bound_vec.size()]);
+        leaf_budget budget(leaves_vec[i % leaves_vec.size()]);
+        if (nearest) {
+          knn(dist, k, e, bound, sort, buffer, i + 1, std::less<Hit>(), budget, context, stats_vec[i]);
+        } else {
+          knn(dist, k, e, bound, sort, buffer, i + 1, std::greater<Hit>(), budget, context, stats_vec[i]);
+        }
+        if (budgeted) {
+          exact_vec[i] = budget.exact;
+        }
+      }
+    });
+    if (!order.empty()) {
+      restore_query_order(buffers, queries.size());
+    }
+    cpp11::writable::list res = assemble_result(buffers, index, true, [this](size_t j) { return _index[j]; }, [this](size_t j) { return point_at(j); });
+    if (budgeted) {
+      res.push_back("exact"_nm = assemble_exact(exact_vec));
+    }
+    if (stats) {
+      res.push_back("stats"_nm = assemble_stats(stats_vec));
+    }
+    return res;
+  }
+
+  // Cursors search best first with nodes and points kept in a single queue
+  // ordered by their distance, or by the bound on the distance of their points
+  // for nodes. A point is handed out once it reaches the front of the queue as
+  // nothing left in the queue can then come before it. Flat trees can't be
+  // modified so a cursor stays valid for as long as its tree
+  class best_first_cursor : public neighbor_cursor {
+    struct Entry {
+      double distance;
+      size_t id;
+      bool point;
+    };
+
+    const flat_tree* _owner;
+    flat_point_distance<dim> _dist;
+    bool _nearest;
+    std::vector<Entry> _queue;
+    size_t _position;
+
+  public:
+    best_first_cursor(const flat_tree* owner, const Point& query, bool nearest) :
+      _owner(owner), _dist(query), _nearest(nearest), _position(0) {
+      push_node(0);
+    }
+
+    cpp11::writable::list next(size_t n, bool index) {
+      std::vector<hit_buffer> buffers(1);
+      hit_buffer& buffer = buffers[0];
+      double distances[LEAF_BLOCK];
+      auto comp = [this](const Entry& a, const Entry& b) { return after(a, b); };
+      while (buffer.index.size() < n && !_queue.empty()) {
+        std::pop_heap(_queue.begin(), _queue.end(), comp);
+        Entry entry = _queue.back();
+        _queue.pop_back();
+        if (entry.point) {
+          buffer.index.push_back(entry.id);
+          buffer.id.push_back(++_position);
+          buffer.distance.push_back(entry.distance);
+          continue;
+        }
+        const flat_node& node = _owner->_nodes[entry.id];
+        if (!node.is_leaf()) {
+          push_node(entry.id + 1);
+          push_node(node.upper);
+          continue;
+        }
+        for (size_t j = node.begin; j < node.end; j += LEAF_BLOCK) {
+          size_t m = std::min<size_t>(LEAF_BLOCK, node.end - j);
+          _dist.leaf(_owner->_coords, j, m, distances);
+          for (size_t l = 0; l < m; ++l) {
+            _queue.push_back({distances[l], j + l, true});
+            std::push_heap(_queue.begin(), _queue.end(), comp);
+          }
+        }
+      }
+      return assemble_result(buffers, index, true, [this](size_t j) { return _owner->_index[j]; }, [this](size_t j) { return _owner->point_at(j); });
+    }
+    bool exhausted() const { return _queue.empty(); }
+    size_t position() const { return _position; }
+
+  private:
+    // The heap keeps the entry that should be handed out next on top. Points
+    // go before nodes at the same distance as the points of the node can't
+    // come before them
+    bool after(const Entry& a, const Entry& b) const {
+      if (a.distance != b.distance) {
+        return _nearest ? a.distance > b.distance : a.distance < b.distance;
+      }
+      return !a.point && b.point;
+    }
+    void push_node(size_t i) {
+      const flat_node& node = _owner->_nodes[i];
+      if (node.begin == node.end) {
+        return;
+      }
+      double bound = _nearest ? _dist.min_node(node) : _dist.max_node(node);
+      _queue.push_back({bound, i, false});
+      std::push_heap(_queue.begin(), _queue.end(), [this](const Entry& a, const Entry& b) { return after(a, b); });
+    }
+  };
+};
+
+// Creates the flat tree matching the dimensionality of an image built from
+// another tree
+inline tree_base* create_flat_tree(std::vector<char> image) {
+  const flat_header* header = flat_image_header(image.data());
+  if (header->dim == 2) {
+    return new flat_tree<2>(std::move(image));
+  }
+  return new flat_tree<3>(std::move(image));
+}
+
+// Maps a saved tree and creates the flat tree matching its dimensionality. This
+// is the only place images come from outside of the process so they are
+// validated here once
+inline tree_base* load_flat_tree(const std::string& file) {
+  std::unique_ptr<mapped_file> mapped(new mapped_file(file));
+  const flat_header* header = validate_flat_image(mapped->data(), mapped->size());
+  if (header->dim == 2) {
+    return new flat_tree<2>(std::move(mapped));
+  }
+  return new flat_tree<3>(std::move(mapped));
+}
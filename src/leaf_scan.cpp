@@ -0,0 +1,139 @@
+#include "leaf_scan.h"
+
+#include <algorithm>
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define ORION_X86_DISPATCH
+#include <immintrin.h>
+#endif
+
+typedef void (*squared_distance_fn)(const double* const*, size_t, size_t, size_t, const double*, double*);
+typedef void (*box_distance_fn)(const double* const*, size_t, size_t, size_t, const double*, const double*, double*);
+
+// The vectorised kernels perform the same operations in the same order as the
+// scalar ones, and handle the remainder of a block with them. The arguments to
+// the max instructions are ordered so ties resolve the same way as std::max
+
+static void squared_distance_scalar(const double* const* coords, size_t dim, size_t begin, size_t n, const double* q, double* out) {
+  for (size_t i = 0; i < n; ++i) {
+    double res = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+      double diff = q[d] - coords[d][begin + i];
+      res += diff * diff;
+    }
+    out[i] = res;
+  }
+}
+
+static void box_distance_scalar(const double* const* coords, size_t dim, size_t begin, size_t n, const double* low, const double* high, double* out) {
+  for (size_t i = 0; i < n; ++i) {
+    double res = 0.0;
+    for (size_t d = 0; d < dim; ++d) {
+      double p = coords[d][begin + i];
+      res += std::max(std::max(low[d] - p, p - high[d]), 0.0);
+    }
+    out[i] = res;
+  }
+}
+
+#ifdef ORION_X86_DISPATCH
+
+__attribute__((target("sse2")))
+static void squared_distance_sse2(const double* const* coords, size_t dim, size_t begin, size_t n, const double* q, double* out) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d res = _mm_setzero_pd();
+    for (size_t d = 0; d < dim; ++d) {
+      __m128d diff = _mm_sub_pd(_mm_set1_pd(q[d]), _mm_loadu_pd(coords[d] + begin + i));
+      res = _mm_add_pd(res, _mm_mul_pd(diff, diff));
+    }
+    _mm_storeu_pd(out + i, res);
+  }
+  squared_distance_scalar(coords, dim, begin + i, n - i, q, out + i);
+}
+
+__attribute__((target("sse2")))
+static void box_distance_sse2(const double* const* coords, size_t dim, size_t begin, size_t n, const double* low, const double* high, double* out) {
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128d res = _mm_setzero_pd();
+    for (size_t d = 0; d < dim; ++d) {
+      __m128d p = _mm_loadu_pd(coords[d] + begin + i);
+      __m128d outside = _mm_max_pd(_mm_sub_pd(p, _mm_set1_pd(high[d])), _mm_sub_pd(_mm_set1_pd(low[d]), p));
+      res = _mm_add_pd(res, _mm_max_pd(_mm_setzero_pd(), outside));
+    }
+    _mm_storeu_pd(out + i, res);
+  }
+  box_distance_scalar(coords, dim, begin + i, n - i, low, high, out + i);
+}
+
+__attribute__((target("avx2")))
+static void squared_distance_avx2(const double* const* coords, size_t dim, size_t begin, size_t n, const double* q, double* out) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d res = _mm256_setzero_pd();
+    for (size_t d = 0; d < dim; ++d) {
+      __m256d diff = _mm256_sub_pd(_mm256_set1_pd(q[d]), _mm256_loadu_pd(coords[d] + begin + i));
+      res = _mm256_add_pd(res, _mm256_mul_pd(diff, diff));
+    }
+    _mm256_storeu_pd(out + i, res);
+  }
+  squared_distance_scalar(coords, dim, begin + i, n - i, q, out + i);
+}
+
+__attribute__((target("avx2")))
+static void box_distance_avx2(const double* const* coords, size_t dim, size_t begin, size_t n, const double* low, const double* high, double* out) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d res = _mm256_setzero_pd();
+    for (size_t d = 0; d < dim; ++d) {
+      __m256d p = _mm256_loadu_pd(coords[d] + begin + i);
+      __m256d outside = _mm256_max_pd(_mm256_sub_pd(p, _mm256_set1_pd(high[d])), _mm256_sub_pd(_mm256_set1_pd(low[d]), p));
+      res = _mm256_add_pd(res, _mm256_max_pd(_mm256_setzero_pd(), outside));
+    }
+    _mm256_storeu_pd(out + i, res);
+  }
+  box_distance_scalar(coords, dim, begin + i, n - i, low, high, out + i);
+}
+
+static bool has_avx2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+static bool has_sse2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static squared_distance_fn select_squared_distance() {
+  if (has_avx2()) return squared_distance_avx2;
+  if (has_sse2()) return squared_distance_sse2;
+  return squared_distance_scalar;
+}
+static box_distance_fn select_box_distance() {
+  if (has_avx2()) return box_distance_avx2;
+  if (has_sse2()) return box_distance_sse2;
+  return box_distance_scalar;
+}
+
+#else
+
+static squared_distance_fn select_squared_distance() {
+  return squared_distance_scalar;
+}
+static box_distance_fn select_box_distance() {
+  return box_distance_scalar;
+}
+
+#endif
+
+// The kernel is selected once, on first use
+void leaf_squared_distance(const double* const* coords, size_t dim, size_t begin, size_t n, const double* q, double* out) {
+  static const squared_distance_fn kernel = select_squared_distance();
+  kernel(coords, dim, begin, n, q, out);
+}
+
+void leaf_box_distance(const double* const* coords, size_t dim, size_t begin, size_t n, const double* low, const double* high, double* out) {
+  static const box_distance_fn kernel = select_box_distance();
+  kernel(coords, dim, begin, n, low, high, out);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstddef>
+
+// Batched distance kernels used when scanning the points of a leaf in the flat
+// layout. Coordinates are read from one array per dimension, starting at
+// `begin`, and a distance is written to `out` for each of the `n` points. The
+// kernels use AVX2 or SSE2 depending on what the CPU supports and fall back to
+// scalar code elsewhere. All variants give identical results. The kernels live
+// in leaf_scan.cpp to keep intrinsics away from the R headers
+
+// Leaves are scanned in blocks of this many points so the distances fit in a
+// buffer on the stack
+static const size_t LEAF_BLOCK = 64;
+
+// Squared euclidean distance to the point `q`
+void leaf_squared_distance(const double* const* coords, size_t dim, size_t begin, size_t n, const double* q, double* out);
+
+// Manhattan (L1) distance to the box spanned by `low` and `high`, zero inside it
+void leaf_box_distance(const double* const* coords, size_t dim, size_t begin, size_t n, const double* low, const double* high, double* out);
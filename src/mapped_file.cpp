@@ -0,0 +1,80 @@
+#include "mapped_file.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+mapped_file::mapped_file(const std::string& path) : _data(nullptr), _size(0), _file(NULL), _mapping(NULL) {
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("Unable to open file for reading");
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(file, &size)) {
+    CloseHandle(file);
+    throw std::runtime_error("Unable to determine file size");
+  }
+  _file = file;
+  _size = static_cast<size_t>(size.QuadPart);
+  if (_size == 0) {
+    return;
+  }
+  HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mapping == NULL) {
+    CloseHandle(file);
+    throw std::runtime_error("Unable to memory map file");
+  }
+  _mapping = mapping;
+  _data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  if (_data == nullptr) {
+    CloseHandle(mapping);
+    CloseHandle(file);
+    throw std::runtime_error("Unable to memory map file");
+  }
+}
+
+mapped_file::~mapped_file() {
+  if (_data != nullptr) UnmapViewOfFile(_data);
+  if (_mapping != NULL) CloseHandle(static_cast<HANDLE>(_mapping));
+  if (_file != NULL) CloseHandle(static_cast<HANDLE>(_file));
+}
+
+#else
+
+mapped_file::mapped_file(const std::string& path) : _data(nullptr), _size(0), _file(nullptr), _mapping(nullptr) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Unable to open file for reading");
+  }
+  struct stat info;
+  if (fstat(fd, &info) == -1) {
+    close(fd);
+    throw std::runtime_error("Unable to determine file size");
+  }
+  _size = static_cast<size_t>(info.st_size);
+  if (_size == 0) {
+    close(fd);
+    return;
+  }
+  void* data = mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    throw std::runtime_error("Unable to memory map file");
+  }
+  _data = static_cast<const char*>(data);
+}
+
+mapped_file::~mapped_file() {
+  if (_data != nullptr) munmap(const_cast<char*>(_data), _size);
+}
+
+#endif
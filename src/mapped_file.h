@@ -0,0 +1,23 @@
+#pragma once
+
+#include <string>
+
+// A read-only memory mapping of a file. The pages are shared between all
+// processes mapping the same file, including forked children. The platform
+// specific parts live in mapped_file.cpp to keep system headers away from the
+// R headers
+class mapped_file {
+  const char* _data;
+  size_t _size;
+  void* _file;
+  void* _mapping;
+
+public:
+  mapped_file(const std::string& path);
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  ~mapped_file();
+
+  const char* data() const { return _data; }
+  size_t size() const { return _size; }
+};
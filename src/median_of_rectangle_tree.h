@@ -3,8 +3,7 @@
 #include "tree.h"
 #include <CGAL/Splitters.h>
 
-class median_of_rectangle_tree_2 : public tree<CGAL::Median_of_rectangle<CGAL::Search_traits_2<Kernel> >, 2> {
-  typedef CGAL::Median_of_rectangle<CGAL::Search_traits_2<Kernel> > Splitter;
+class median_of_rectangle_tree_2 : public tree<CGAL::Median_of_rectangle, 2> {
 public:
   using tree::tree;
   ~median_of_rectangle_tree_2() = default;
@@ -18,8 +17,7 @@ protected:
 };
 typedef cpp11::external_pointer<median_of_rectangle_tree_2> median_of_rectangle_tree_2_p;
 
-class median_of_rectangle_tree_3 : public tree<CGAL::Median_of_rectangle<CGAL::Search_traits_3<Kernel> >, 3> {
-  typedef CGAL::Median_of_rectangle<CGAL::Search_traits_3<Kernel> > Splitter;
+class median_of_rectangle_tree_3 : public tree<CGAL::Median_of_rectangle, 3> {
 public:
   using tree::tree;
   ~median_of_rectangle_tree_3() = default;
@@ -32,3 +30,31 @@ protected:
   }
 };
 typedef cpp11::external_pointer<median_of_rectangle_tree_3> median_of_rectangle_tree_3_p;
+
+class median_of_rectangle_tree_2_double : public tree<CGAL::Median_of_rectangle, 2, Double_kernel> {
+public:
+  using tree::tree;
+  ~median_of_rectangle_tree_2_double() = default;
+
+  std::string split_type() const { return "median of rectangle"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket);
+  }
+};
+typedef cpp11::external_pointer<median_of_rectangle_tree_2_double> median_of_rectangle_tree_2_double_p;
+
+class median_of_rectangle_tree_3_double : public tree<CGAL::Median_of_rectangle, 3, Double_kernel> {
+public:
+  using tree::tree;
+  ~median_of_rectangle_tree_3_double() = default;
+
+  std::string split_type() const { return "median of rectangle"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket);
+  }
+};
+typedef cpp11::external_pointer<median_of_rectangle_tree_3_double> median_of_rectangle_tree_3_double_p;
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <CGAL/Kd_tree_rectangle.h>
+#include <CGAL/Euclidean_distance.h>
+#include <CGAL/number_utils.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include <cpp11/protect.hpp>
+
+// Metrics used for point queries. Distances are accumulated one coordinate at a
+// time in the transformed space used by CGAL: term() gives the contribution of
+// a single coordinate difference, combine() folds it into the distance, and
+// update() swaps the contribution of a coordinate for a new one. Each of the
+// common metrics is its own type so that searches are specialised for it, while
+// weighted_lp_metric covers the general case at the cost of a pow() per
+// coordinate
+struct l1_metric {
+  template<typename FT> FT term(const FT& diff, int) const { return CGAL::abs(diff); }
+  template<typename FT> FT combine(const FT& dist, const FT& term) const { return dist + term; }
+  template<typename FT> FT update(const FT& dist, const FT& old_term, const FT& new_term) const { return dist + new_term - old_term; }
+  template<typename FT> FT transform(const FT& d) const { return d; }
+  template<typename FT> FT inverse(const FT& d) const { return d; }
+};
+
+struct l2_metric {
+  template<typename FT> FT term(const FT& diff, int) const { return diff * diff; }
+  template<typename FT> FT combine(const FT& dist, const FT& term) const { return dist + term; }
+  template<typename FT> FT update(const FT& dist, const FT& old_term, const FT& new_term) const { return dist + new_term - old_term; }
+  template<typename FT> FT transform(const FT& d) const { return d * d; }
+  template<typename FT> FT inverse(const FT& d) const { return FT(std::sqrt(CGAL::to_double(d))); }
+};
+
+struct linf_metric {
+  template<typename FT> FT term(const FT& diff, int) const { return CGAL::abs(diff); }
+  template<typename FT> FT combine(const FT& dist, const FT& term) const { return std::max(dist, term); }
+  template<typename FT> FT update(const FT& dist, const FT& old_term, const FT& new_term) const { return std::max(dist, new_term); }
+  template<typename FT> FT transform(const FT& d) const { return d; }
+  template<typename FT> FT inverse(const FT& d) const { return d; }
+};
+
+// An infinite power gives the weighted maximum norm
+struct weighted_lp_metric {
+  double p;
+  std::vector<double> w;
+
+  weighted_lp_metric(double p, std::vector<double> w) : p(p), w(w) {}
+
+  template<typename FT> FT term(const FT& diff, int d) const {
+    double abs_diff = std::abs(CGAL::to_double(diff));
+    return FT(std::isinf(p) ? w[d] * abs_diff : w[d] * std::pow(abs_diff, p));
+  }
+  template<typename FT> FT combine(const FT& dist, const FT& term) const {
+    return std::isinf(p) ? std::max(dist, term) : dist + term;
+  }
+  template<typename FT> FT update(const FT& dist, const FT& old_term, const FT& new_term) const {
+    return std::isinf(p) ? std::max(dist, new_term) : dist + new_term - old_term;
+  }
+  template<typename FT> FT transform(const FT& d) const {
+    return std::isinf(p) ? d : FT(std::pow(CGAL::to_double(d), p));
+  }
+  template<typename FT> FT inverse(const FT& d) const {
+    return std::isinf(p) ? d : FT(std::pow(CGAL::to_double(d), 1.0 / p));
+  }
+};
+
+// Calls search with the metric matching the name given from R. The weights
+// are only used for the weighted metric
+template<typename F>
+auto dispatch_metric(const std::string& metric, double p, const std::vector<double>& weights, size_t dim, F search) -> decltype(search(l2_metric())) {
+  if (metric == "L1") return search(l1_metric());
+  if (metric == "L2") return search(l2_metric());
+  if (metric == "Linf") return search(linf_metric());
+  if (weights.size() != dim) {
+    cpp11::stop("A weight for each dimension must be given");
+  }
+  return search(weighted_lp_metric(p, weights));
+}
+
+// A distance between points under one of the metrics above, modelling the
+// OrthogonalDistance concept of CGAL
+template<typename Traits, typename Metric>
+class metric_distance {
+public:
+  typedef typename Traits::FT FT;
+  typedef typename Traits::Point_d Point_d;
+  typedef Point_d Query_item;
+  typedef typename Traits::Dimension D;
+  typedef CGAL::Kd_tree_rectangle<FT, D> Rectangle;
+
+private:
+  Metric _metric;
+
+public:
+  metric_distance(const Metric& metric = Metric()) : _metric(metric) {}
+
+  FT transformed_distance(const Query_item& q, const Point_d& p) const {
+    FT res(0);
+    for (int d = 0; d < D::value; ++d) {
+      res = _metric.combine(res, _metric.term(FT(q.cartesian(d) - p.cartesian(d)), d));
+    }
+    return res;
+  }
+
+  FT min_distance_to_rectangle(const Query_item& q, const Rectangle& r) const {
+    FT res(0);
+    for (int d = 0; d < D::value; ++d) {
+      res = _metric.combine(res, _metric.term(min_offset(q, r, d), d));
+    }
+    return res;
+  }
+  FT min_distance_to_rectangle(const Query_item& q, const Rectangle& r, std::vector<FT>& dists) const {
+    FT res(0);
+    for (int d = 0; d < D::value; ++d) {
+      dists[d] = min_offset(q, r, d);
+      res = _metric.combine(res, _metric.term(dists[d], d));
+    }
+    return res;
+  }
+
+  FT max_distance_to_rectangle(const Query_item& q, const Rectangle& r) const {
+    FT res(0);
+    for (int d = 0; d < D::value; ++d) {
+      res = _metric.combine(res, _metric.term(max_offset(q, r, d), d));
+    }
+    return res;
+  }
+  FT max_distance_to_rectangle(const Query_item& q, const Rectangle& r, std::vector<FT>& dists) const {
+    FT res(0);
+    for (int d = 0; d < D::value; ++d) {
+      dists[d] = max_offset(q, r, d);
+      res = _metric.combine(res, _metric.term(dists[d], d));
+    }
+    return res;
+  }
+
+  FT new_distance(FT dist, FT old_off, FT new_off, int cutting_dimension) const {
+    return _metric.update(dist, _metric.term(old_off, cutting_dimension), _metric.term(new_off, cutting_dimension));
+  }
+
+  FT transformed_distance(FT d) const { return _metric.transform(d); }
+  FT inverse_of_transformed_distance(FT d) const { return _metric.inverse(d); }
+
+private:
+  static FT min_offset(const Query_item& q, const Rectangle& r, int d) {
+    if (q.cartesian(d) < r.min_coord(d)) return r.min_coord(d) - q.cartesian(d);
+    if (q.cartesian(d) > r.max_coord(d)) return q.cartesian(d) - r.max_coord(d);
+    return FT(0);
+  }
+  static FT max_offset(const Query_item& q, const Rectangle& r, int d) {
+    if (q.cartesian(d) <= (r.min_coord(d) + r.max_coord(d)) / FT(2)) return r.max_coord(d) - q.cartesian(d);
+    return q.cartesian(d) - r.min_coord(d);
+  }
+};
+
+// The CGAL distance class used for a metric. Euclidean searches keep using the
+// distance class provided by CGAL
+template<typename Traits, typename Metric>
+struct point_distance {
+  typedef metric_distance<Traits, Metric> type;
+  static type create(const Metric& metric) { return type(metric); }
+};
+template<typename Traits>
+struct point_distance<Traits, l2_metric> {
+  typedef CGAL::Euclidean_distance<Traits> type;
+  static type create(const l2_metric&) { return type(); }
+};
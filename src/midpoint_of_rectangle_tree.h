@@ -3,8 +3,7 @@
 #include "tree.h"
 #include <CGAL/Splitters.h>
 
-class midpoint_of_rectangle_tree_2 : public tree<CGAL::Midpoint_of_rectangle<CGAL::Search_traits_2<Kernel> >, 2> {
-  typedef CGAL::Midpoint_of_rectangle<CGAL::Search_traits_2<Kernel> > Splitter;
+class midpoint_of_rectangle_tree_2 : public tree<CGAL::Midpoint_of_rectangle, 2> {
 public:
   using tree::tree;
   ~midpoint_of_rectangle_tree_2() = default;
@@ -18,8 +17,7 @@ protected:
 };
 typedef cpp11::external_pointer<midpoint_of_rectangle_tree_2> midpoint_of_rectangle_tree_2_p;
 
-class midpoint_of_rectangle_tree_3 : public tree<CGAL::Midpoint_of_rectangle<CGAL::Search_traits_3<Kernel> >, 3> {
-  typedef CGAL::Midpoint_of_rectangle<CGAL::Search_traits_3<Kernel> > Splitter;
+class midpoint_of_rectangle_tree_3 : public tree<CGAL::Midpoint_of_rectangle, 3> {
 public:
   using tree::tree;
   ~midpoint_of_rectangle_tree_3() = default;
@@ -32,3 +30,31 @@ protected:
   }
 };
 typedef cpp11::external_pointer<midpoint_of_rectangle_tree_3> midpoint_of_rectangle_tree_3_p;
+
+class midpoint_of_rectangle_tree_2_double : public tree<CGAL::Midpoint_of_rectangle, 2, Double_kernel> {
+public:
+  using tree::tree;
+  ~midpoint_of_rectangle_tree_2_double() = default;
+
+  std::string split_type() const { return "midpoint of rectangle"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket);
+  }
+};
+typedef cpp11::external_pointer<midpoint_of_rectangle_tree_2_double> midpoint_of_rectangle_tree_2_double_p;
+
+class midpoint_of_rectangle_tree_3_double : public tree<CGAL::Midpoint_of_rectangle, 3, Double_kernel> {
+public:
+  using tree::tree;
+  ~midpoint_of_rectangle_tree_3_double() = default;
+
+  std::string split_type() const { return "midpoint of rectangle"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket);
+  }
+};
+typedef cpp11::external_pointer<midpoint_of_rectangle_tree_3_double> midpoint_of_rectangle_tree_3_double_p;
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+
+// A consecutive range of queries handled as a single unit of work
+struct chunk {
+  size_t begin;
+  size_t end;
+};
+
+// Splits n queries into chunks. More chunks than threads are created so that
+// workers finishing early can pick up remaining work
+inline std::vector<chunk> split_chunks(size_t n, size_t threads) {
+  std::vector<chunk> chunks;
+  if (n == 0) {
+    return chunks;
+  }
+  size_t n_chunks = threads <= 1 ? 1 : std::min(n, threads * 4);
+  size_t size = (n + n_chunks - 1) / n_chunks;
+  for (size_t begin = 0; begin < n; begin += size) {
+    chunks.push_back({begin, std::min(n, begin + size)});
+  }
+  return chunks;
+}
+
+// Calls fun(i) for each chunk index using a pool of worker threads. fun must
+// not touch the R API. Exceptions thrown by a worker are rethrown on the
+// calling thread once all workers have finished
+template<typename F>
+void parallel_for(size_t n_chunks, size_t threads, F fun) {
+  threads = std::min(threads, n_chunks);
+  if (threads <= 1) {
+    for (size_t i = 0; i < n_chunks; ++i) {
+      fun(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next(0);
+  std::vector<std::exception_ptr> errors(threads);
+  std::vector<std::thread> workers;
+  workers.reserve(threads);
+  for (size_t t = 0; t < threads; ++t) {
+    workers.emplace_back([&, t]() {
+      try {
+        for (size_t i = next++; i < n_chunks; i = next++) {
+          fun(i);
+        }
+      } catch (...) {
+        errors[t] = std::current_exception();
+        next = n_chunks;
+      }
+    });
+  }
+  for (auto iter = workers.begin(); iter != workers.end(); iter++) {
+    iter->join();
+  }
+  for (auto iter = errors.begin(); iter != errors.end(); iter++) {
+    if (*iter) {
+      std::rethrow_exception(*iter);
+    }
+  }
+}
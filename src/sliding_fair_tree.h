@@ -3,8 +3,7 @@
 #include "tree.h"
 #include <CGAL/Splitters.h>
 
-class sliding_fair_tree_2 : public tree<CGAL::Sliding_fair<CGAL::Search_traits_2<Kernel> >, 2> {
-  typedef CGAL::Sliding_fair<CGAL::Search_traits_2<Kernel> > Splitter;
+class sliding_fair_tree_2 : public tree<CGAL::Sliding_fair, 2> {
 public:
   using tree::tree;
   ~sliding_fair_tree_2() = default;
@@ -18,8 +17,7 @@ protected:
 };
 typedef cpp11::external_pointer<sliding_fair_tree_2> sliding_fair_tree_2_p;
 
-class sliding_fair_tree_3 : public tree<CGAL::Sliding_fair<CGAL::Search_traits_3<Kernel> >, 3> {
-  typedef CGAL::Sliding_fair<CGAL::Search_traits_3<Kernel> > Splitter;
+class sliding_fair_tree_3 : public tree<CGAL::Sliding_fair, 3> {
 public:
   using tree::tree;
   ~sliding_fair_tree_3() = default;
@@ -32,3 +30,31 @@ protected:
   }
 };
 typedef cpp11::external_pointer<sliding_fair_tree_3> sliding_fair_tree_3_p;
+
+class sliding_fair_tree_2_double : public tree<CGAL::Sliding_fair, 2, Double_kernel> {
+public:
+  using tree::tree;
+  ~sliding_fair_tree_2_double() = default;
+
+  std::string split_type() const { return "sliding fair"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket, aspect);
+  }
+};
+typedef cpp11::external_pointer<sliding_fair_tree_2_double> sliding_fair_tree_2_double_p;
+
+class sliding_fair_tree_3_double : public tree<CGAL::Sliding_fair, 3, Double_kernel> {
+public:
+  using tree::tree;
+  ~sliding_fair_tree_3_double() = default;
+
+  std::string split_type() const { return "sliding fair"; }
+
+protected:
+  Splitter create_splitter(size_t bucket, double aspect) {
+    return Splitter(bucket, aspect);
+  }
+};
+typedef cpp11::external_pointer<sliding_fair_tree_3_double> sliding_fair_tree_3_double_p;
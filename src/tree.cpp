@@ -6,86 +6,211 @@
 #include "midpoint_of_rectangle_tree.h"
 #include "sliding_midpoint_tree.h"
 #include "sliding_fair_tree.h"
+#include "flat_tree.h"
 
 // Constructors
 
 [[cpp11::register]]
 fair_tree_2_p create_fair_tree_2(SEXP points, int bucket, double aspect) {
   fair_tree_2 *tree(new fair_tree_2(points, bucket, aspect));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 fair_tree_3_p create_fair_tree_3(SEXP points, int bucket, double aspect) {
   fair_tree_3 *tree(new fair_tree_3(points, bucket, aspect));
+  tree->build();
   return {tree};
 }
 
 [[cpp11::register]]
 median_of_max_spread_tree_2_p create_median_of_max_spread_tree_2(SEXP points, int bucket) {
   median_of_max_spread_tree_2 *tree(new median_of_max_spread_tree_2(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 median_of_max_spread_tree_3_p create_median_of_max_spread_tree_3(SEXP points, int bucket) {
   median_of_max_spread_tree_3 *tree(new median_of_max_spread_tree_3(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 
 [[cpp11::register]]
 median_of_rectangle_tree_2_p create_median_of_rectangle_tree_2(SEXP points, int bucket) {
   median_of_rectangle_tree_2 *tree(new median_of_rectangle_tree_2(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 median_of_rectangle_tree_3_p create_median_of_rectangle_tree_3(SEXP points, int bucket) {
   median_of_rectangle_tree_3 *tree(new median_of_rectangle_tree_3(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 
 [[cpp11::register]]
 midpoint_of_max_spread_tree_2_p create_midpoint_of_max_spread_tree_2(SEXP points, int bucket) {
   midpoint_of_max_spread_tree_2 *tree(new midpoint_of_max_spread_tree_2(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 midpoint_of_max_spread_tree_3_p create_midpoint_of_max_spread_tree_3(SEXP points, int bucket) {
   midpoint_of_max_spread_tree_3 *tree(new midpoint_of_max_spread_tree_3(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 
 [[cpp11::register]]
 midpoint_of_rectangle_tree_2_p create_midpoint_of_rectangle_tree_2(SEXP points, int bucket) {
   midpoint_of_rectangle_tree_2 *tree(new midpoint_of_rectangle_tree_2(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 midpoint_of_rectangle_tree_3_p create_midpoint_of_rectangle_tree_3(SEXP points, int bucket) {
   midpoint_of_rectangle_tree_3 *tree(new midpoint_of_rectangle_tree_3(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 
 [[cpp11::register]]
 sliding_fair_tree_2_p create_sliding_fair_tree_2(SEXP points, int bucket, double aspect) {
   sliding_fair_tree_2 *tree(new sliding_fair_tree_2(points, bucket, aspect));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 sliding_fair_tree_3_p create_sliding_fair_tree_3(SEXP points, int bucket, double aspect) {
   sliding_fair_tree_3 *tree(new sliding_fair_tree_3(points, bucket, aspect));
+  tree->build();
   return {tree};
 }
 
 [[cpp11::register]]
 sliding_midpoint_tree_2_p create_sliding_midpoint_tree_2(SEXP points, int bucket) {
   sliding_midpoint_tree_2 *tree(new sliding_midpoint_tree_2(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 [[cpp11::register]]
 sliding_midpoint_tree_3_p create_sliding_midpoint_tree_3(SEXP points, int bucket) {
   sliding_midpoint_tree_3 *tree(new sliding_midpoint_tree_3(points, bucket, 0.0));
+  tree->build();
   return {tree};
 }
 
+// Double precision constructors
+
+[[cpp11::register]]
+fair_tree_2_double_p create_fair_tree_2_double(SEXP points, int bucket, double aspect, int threads) {
+  fair_tree_2_double *tree(new fair_tree_2_double(points, bucket, aspect, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+fair_tree_3_double_p create_fair_tree_3_double(SEXP points, int bucket, double aspect, int threads) {
+  fair_tree_3_double *tree(new fair_tree_3_double(points, bucket, aspect, threads));
+  tree->build();
+  return {tree};
+}
+
+[[cpp11::register]]
+median_of_max_spread_tree_2_double_p create_median_of_max_spread_tree_2_double(SEXP points, int bucket, int threads) {
+  median_of_max_spread_tree_2_double *tree(new median_of_max_spread_tree_2_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+median_of_max_spread_tree_3_double_p create_median_of_max_spread_tree_3_double(SEXP points, int bucket, int threads) {
+  median_of_max_spread_tree_3_double *tree(new median_of_max_spread_tree_3_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+
+[[cpp11::register]]
+median_of_rectangle_tree_2_double_p create_median_of_rectangle_tree_2_double(SEXP points, int bucket, int threads) {
+  median_of_rectangle_tree_2_double *tree(new median_of_rectangle_tree_2_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+median_of_rectangle_tree_3_double_p create_median_of_rectangle_tree_3_double(SEXP points, int bucket, int threads) {
+  median_of_rectangle_tree_3_double *tree(new median_of_rectangle_tree_3_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+
+[[cpp11::register]]
+midpoint_of_max_spread_tree_2_double_p create_midpoint_of_max_spread_tree_2_double(SEXP points, int bucket, int threads) {
+  midpoint_of_max_spread_tree_2_double *tree(new midpoint_of_max_spread_tree_2_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+midpoint_of_max_spread_tree_3_double_p create_midpoint_of_max_spread_tree_3_double(SEXP points, int bucket, int threads) {
+  midpoint_of_max_spread_tree_3_double *tree(new midpoint_of_max_spread_tree_3_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+
+[[cpp11::register]]
+midpoint_of_rectangle_tree_2_double_p create_midpoint_of_rectangle_tree_2_double(SEXP points, int bucket, int threads) {
+  midpoint_of_rectangle_tree_2_double *tree(new midpoint_of_rectangle_tree_2_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+midpoint_of_rectangle_tree_3_double_p create_midpoint_of_rectangle_tree_3_double(SEXP points, int bucket, int threads) {
+  midpoint_of_rectangle_tree_3_double *tree(new midpoint_of_rectangle_tree_3_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+
+[[cpp11::register]]
+sliding_fair_tree_2_double_p create_sliding_fair_tree_2_double(SEXP points, int bucket, double aspect, int threads) {
+  sliding_fair_tree_2_double *tree(new sliding_fair_tree_2_double(points, bucket, aspect, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+sliding_fair_tree_3_double_p create_sliding_fair_tree_3_double(SEXP points, int bucket, double aspect, int threads) {
+  sliding_fair_tree_3_double *tree(new sliding_fair_tree_3_double(points, bucket, aspect, threads));
+  tree->build();
+  return {tree};
+}
+
+[[cpp11::register]]
+sliding_midpoint_tree_2_double_p create_sliding_midpoint_tree_2_double(SEXP points, int bucket, int threads) {
+  sliding_midpoint_tree_2_double *tree(new sliding_midpoint_tree_2_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+[[cpp11::register]]
+sliding_midpoint_tree_3_double_p create_sliding_midpoint_tree_3_double(SEXP points, int bucket, int threads) {
+  sliding_midpoint_tree_3_double *tree(new sliding_midpoint_tree_3_double(points, bucket, 0.0, threads));
+  tree->build();
+  return {tree};
+}
+
+// Converts a tree to the flat engine. The source tree is released straight
+// away so the two never have to be held in memory for longer than needed
+[[cpp11::register]]
+tree_base_p tree_flatten(tree_base_p tree) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  tree_base *flat(create_flat_tree(tree->flatten()));
+  tree.reset();
+  return {flat};
+}
+
+[[cpp11::register]]
+tree_base_p tree_load(std::string file) {
+  tree_base *tree(load_flat_tree(file));
+  return {tree};
+}
 
 // Basic info
 
@@ -105,6 +230,22 @@ cpp11::writable::strings tree_split_type(tree_base_p tree) {
   return {tree->split_type()};
 }
 
+[[cpp11::register]]
+cpp11::writable::strings tree_precision(tree_base_p tree) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return {tree->precision()};
+}
+
+[[cpp11::register]]
+cpp11::writable::strings tree_engine(tree_base_p tree) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return {tree->engine()};
+}
+
 [[cpp11::register]]
 cpp11::writable::integers tree_size(tree_base_p tree) {
   if (tree.get() == nullptr) {
@@ -137,6 +278,22 @@ SEXP tree_points(tree_base_p tree) {
   return tree->points();
 }
 
+[[cpp11::register]]
+SEXP tree_shape(tree_base_p tree) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->shape();
+}
+
+[[cpp11::register]]
+bool tree_weighted(tree_base_p tree) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->weighted();
+}
+
 [[cpp11::register]]
 SEXP tree_bbox(tree_base_p tree) {
   if (tree.get() == nullptr) {
@@ -148,41 +305,162 @@ SEXP tree_bbox(tree_base_p tree) {
 // Searches
 
 [[cpp11::register]]
-SEXP tree_point_search(tree_base_p tree, SEXP points, cpp11::integers n, SEXP eps, bool nearest, bool sort) {
+SEXP tree_point_search(tree_base_p tree, SEXP points, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder, std::string metric, double p, cpp11::doubles weights) {
   if (tree.get() == nullptr) {
     cpp11::stop("Data structure pointer cleared from memory");
   }
-  return tree->point_search(points, n, eps, nearest, sort);
+  return tree->point_search(points, n, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder, metric, p, weights);
 }
 
 [[cpp11::register]]
-SEXP tree_spheroid_search(tree_base_p tree, SEXP spheroids, cpp11::integers n, SEXP eps, bool nearest, bool sort) {
+SEXP tree_spheroid_search(tree_base_p tree, SEXP spheroids, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) {
   if (tree.get() == nullptr) {
     cpp11::stop("Data structure pointer cleared from memory");
   }
-  return tree->spheroid_search(spheroids, n, eps, nearest, sort);
+  return tree->spheroid_search(spheroids, n, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
 }
 
 [[cpp11::register]]
-SEXP tree_box_search(tree_base_p tree, SEXP boxes, cpp11::integers n, SEXP eps, bool nearest, bool sort) {
+SEXP tree_box_search(tree_base_p tree, SEXP boxes, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) {
   if (tree.get() == nullptr) {
     cpp11::stop("Data structure pointer cleared from memory");
   }
-  return tree->box_search(boxes, n, eps, nearest, sort);
+  return tree->box_search(boxes, n, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
 }
 
 [[cpp11::register]]
-SEXP tree_spheroid_range(tree_base_p tree, SEXP spheroids, SEXP eps) {
+SEXP tree_spheroid_range(tree_base_p tree, SEXP spheroids, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) {
   if (tree.get() == nullptr) {
     cpp11::stop("Data structure pointer cleared from memory");
   }
-  return tree->spheroid_range(spheroids, eps);
+  return tree->spheroid_range(spheroids, eps, index, stats, threads, reorder, unique);
 }
 
 [[cpp11::register]]
-SEXP tree_box_range(tree_base_p tree, SEXP boxes, SEXP eps) {
+SEXP tree_box_range(tree_base_p tree, SEXP boxes, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->box_range(boxes, eps, index, stats, threads, reorder, unique);
+}
+
+[[cpp11::register]]
+SEXP tree_spheroid_count(tree_base_p tree, SEXP spheroids, SEXP eps, bool any, int threads) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->spheroid_count(spheroids, eps, any, threads);
+}
+
+[[cpp11::register]]
+SEXP tree_box_count(tree_base_p tree, SEXP boxes, SEXP eps, bool any, int threads) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->box_count(boxes, eps, any, threads);
+}
+
+[[cpp11::register]]
+SEXP tree_spheroid_aggregate(tree_base_p tree, SEXP spheroids, SEXP eps, int threads) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->spheroid_aggregate(spheroids, eps, threads);
+}
+
+[[cpp11::register]]
+SEXP tree_box_aggregate(tree_base_p tree, SEXP boxes, SEXP eps, int threads) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->box_aggregate(boxes, eps, threads);
+}
+
+// Graphs
+
+[[cpp11::register]]
+SEXP tree_knn_graph(tree_base_p tree, int k, int threads) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return assemble_knn_graph(tree->flat_image(), k, threads);
+}
+
+[[cpp11::register]]
+SEXP tree_join(tree_base_p tree_a, tree_base_p tree_b, double r, double eps, int threads) {
+  if (tree_a.get() == nullptr || tree_b.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return assemble_join(tree_a->flat_image(), tree_b->flat_image(), r, eps, threads);
+}
+
+// Cursors
+
+[[cpp11::register]]
+neighbor_cursor_p tree_cursor(tree_base_p tree, SEXP point, bool nearest) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  neighbor_cursor *cursor(tree->cursor(point, nearest));
+  return {cursor};
+}
+
+[[cpp11::register]]
+SEXP cursor_next(neighbor_cursor_p cursor, int n, bool index) {
+  if (cursor.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return cursor->next(n, index);
+}
+
+[[cpp11::register]]
+bool cursor_exhausted(neighbor_cursor_p cursor) {
+  if (cursor.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return cursor->exhausted();
+}
+
+[[cpp11::register]]
+int cursor_position(neighbor_cursor_p cursor) {
+  if (cursor.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return cursor->position();
+}
+
+// Modification
+
+[[cpp11::register]]
+cpp11::writable::integers tree_insert(tree_base_p tree, SEXP points, cpp11::doubles weights) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  return tree->insert(points, weights);
+}
+
+[[cpp11::register]]
+void tree_remove(tree_base_p tree, cpp11::integers index) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  tree->remove(index);
+}
+
+[[cpp11::register]]
+void tree_set_weights(tree_base_p tree, cpp11::doubles weights) {
+  if (tree.get() == nullptr) {
+    cpp11::stop("Data structure pointer cleared from memory");
+  }
+  tree->set_weights(weights);
+}
+
+// Persistence
+
+[[cpp11::register]]
+void tree_save(tree_base_p tree, std::string file) {
   if (tree.get() == nullptr) {
     cpp11::stop("Data structure pointer cleared from memory");
   }
-  return tree->box_range(boxes, eps);
+  tree->save(file);
 }
@@ -5,28 +5,81 @@
 #include <CGAL/Search_traits_3.h>
 #include <CGAL/Splitters.h>
 #include <CGAL/Orthogonal_k_neighbor_search.h>
+#include <CGAL/Orthogonal_incremental_neighbor_search.h>
 #include <CGAL/K_neighbor_search.h>
-#include <CGAL/Weighted_Minkowski_distance.h>
 #include <CGAL/Euclidean_distance.h>
 #include <CGAL/Euclidean_distance_sphere_point.h>
 #include <CGAL/Manhattan_distance_iso_box_point.h>
 #include <CGAL/Fuzzy_iso_box.h>
 #include <CGAL/Fuzzy_sphere.h>
+#include <CGAL/Search_traits_adapter.h>
+#include <CGAL/Simple_cartesian.h>
+
+#ifdef CGAL_LINKED_WITH_TBB
+#include <tbb/task_arena.h>
+#endif
+
+#include <boost/iterator/counting_iterator.hpp>
+#include <boost/property_map/property_map.hpp>
 
 #include <vector>
 #include <string>
 #include <typeinfo>
+#include <cmath>
+#include <utility>
+#include <memory>
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <unordered_set>
+#include <limits>
+#include <cstdint>
+#include <type_traits>
 
 #include <cpp11/strings.hpp>
 #include <cpp11/external_pointer.hpp>
 #include <cpp11/integers.hpp>
 #include <cpp11/list.hpp>
 #include <cpp11/doubles.hpp>
+#include <cpp11/logicals.hpp>
 
 #include <euclid.h>
 
+#include "parallel.h"
+#include "flat_layout.h"
+#include "dual_tree.h"
+#include "metrics.h"
+
 using namespace cpp11::literals;
 
+// Inexact kernel used for double precision trees
+typedef CGAL::Simple_cartesian<double> Double_kernel;
+
+// A tree in the flat layout, either borrowed from a tree stored in it or
+// converted into storage shared with the tree that caches it
+struct flat_image_ref {
+  std::shared_ptr<const std::vector<char>> storage;
+  const char* borrowed = nullptr;
+  size_t borrowed_size = 0;
+
+  const char* data() const { return borrowed == nullptr ? storage->data() : borrowed; }
+  size_t size() const { return borrowed == nullptr ? storage->size() : borrowed_size; }
+};
+
+// An incremental nearest or furthest neighbor search from a single point.
+// Neighbors are handed out in distance order a batch at a time and the state of
+// the traversal is kept between batches, so the tree is only searched as far
+// as the neighbors actually requested
+class neighbor_cursor {
+public:
+  virtual ~neighbor_cursor() = default;
+
+  virtual cpp11::writable::list next(size_t n, bool index) = 0;
+  virtual bool exhausted() const = 0;
+  virtual size_t position() const = 0;
+};
+typedef cpp11::external_pointer<neighbor_cursor> neighbor_cursor_p;
+
 class tree_base {
 public:
   tree_base() {}
@@ -36,22 +89,40 @@ public:
   // Type
   virtual size_t dimension() const = 0;
   virtual std::string split_type() const = 0;
+  virtual std::string precision() const = 0;
   virtual size_t bucket_size() const = 0;
   virtual double aspect_ratio() const = 0;
+  virtual std::string engine() const = 0;
 
   // Content
   virtual size_t size() const = 0;
   virtual SEXP points() const = 0;
   virtual SEXP bbox() const = 0;
+  virtual cpp11::writable::list shape() const = 0;
+  virtual bool weighted() const = 0;
 
   // Search
-  //virtual SEXP point_search(SEXP points, size_t n, Exact_number eps, bool nearest, bool sort, bool minkowski, double p, cpp11::doubles w) const = 0;
-  virtual cpp11::writable::list point_search(SEXP points, cpp11::integers n, SEXP eps, bool nearest, bool sort) const = 0;
-  virtual cpp11::writable::list spheroid_search(SEXP spheroids, cpp11::integers n, SEXP eps, bool nearest, bool sort) const = 0;
-  virtual cpp11::writable::list box_search(SEXP boxes, cpp11::integers n, SEXP eps, bool nearest, bool sort) const = 0;
+  virtual cpp11::writable::list point_search(SEXP points, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder, std::string metric, double p, cpp11::doubles weights) const = 0;
+  virtual cpp11::writable::list spheroid_search(SEXP spheroids, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const = 0;
+  virtual cpp11::writable::list box_search(SEXP boxes, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const = 0;
+
+  virtual cpp11::writable::list spheroid_range(SEXP spheroids, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const = 0;
+  virtual cpp11::writable::list box_range(SEXP boxes, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const = 0;
+  virtual SEXP spheroid_count(SEXP spheroids, SEXP eps, bool any, int threads) const = 0;
+  virtual SEXP box_count(SEXP boxes, SEXP eps, bool any, int threads) const = 0;
+  virtual SEXP spheroid_aggregate(SEXP spheroids, SEXP eps, int threads) const = 0;
+  virtual SEXP box_aggregate(SEXP boxes, SEXP eps, int threads) const = 0;
+  virtual neighbor_cursor* cursor(SEXP point, bool nearest) const = 0;
 
-  virtual cpp11::writable::list spheroid_range(SEXP spheroids, SEXP eps) const = 0;
-  virtual cpp11::writable::list box_range(SEXP boxes, SEXP eps) const = 0;
+  // Modification
+  virtual cpp11::writable::integers insert(SEXP points, cpp11::doubles weights) = 0;
+  virtual void remove(cpp11::integers index) = 0;
+  virtual void set_weights(cpp11::doubles weights) = 0;
+
+  // Persistence
+  virtual std::vector<char> flatten() = 0;
+  virtual flat_image_ref flat_image() = 0;
+  virtual void save(const std::string& file) = 0;
 };
 typedef cpp11::external_pointer<tree_base> tree_base_p;
 
@@ -110,156 +181,1751 @@ inline std::vector<Iso_cuboid> get_euclid_vec(SEXP geo) {
   return euclid::get_iso_cube_vec(geo);
 }
 
-template<typename Splitter, size_t dim>
+// Conversion between the exact kernel and the double precision kernel
+inline Double_kernel::Point_2 to_double_kernel(const Point_2& geo) {
+  return Double_kernel::Point_2(CGAL::to_double(geo.x()), CGAL::to_double(geo.y()));
+}
+inline Double_kernel::Point_3 to_double_kernel(const Point_3& geo) {
+  return Double_kernel::Point_3(CGAL::to_double(geo.x()), CGAL::to_double(geo.y()), CGAL::to_double(geo.z()));
+}
+inline Double_kernel::Circle_2 to_double_kernel(const Circle_2& geo) {
+  return Double_kernel::Circle_2(to_double_kernel(geo.center()), CGAL::to_double(geo.squared_radius()));
+}
+inline Double_kernel::Sphere_3 to_double_kernel(const Sphere& geo) {
+  return Double_kernel::Sphere_3(to_double_kernel(geo.center()), CGAL::to_double(geo.squared_radius()));
+}
+inline Double_kernel::Iso_rectangle_2 to_double_kernel(const Iso_rectangle& geo) {
+  return Double_kernel::Iso_rectangle_2(to_double_kernel(geo.min()), to_double_kernel(geo.max()));
+}
+inline Double_kernel::Iso_cuboid_3 to_double_kernel(const Iso_cuboid& geo) {
+  return Double_kernel::Iso_cuboid_3(to_double_kernel(geo.min()), to_double_kernel(geo.max()));
+}
+inline const Point_2& to_exact_kernel(const Point_2& geo) {
+  return geo;
+}
+inline const Point_3& to_exact_kernel(const Point_3& geo) {
+  return geo;
+}
+inline Point_2 to_exact_kernel(const Double_kernel::Point_2& geo) {
+  return Point_2(geo.x(), geo.y());
+}
+inline Point_3 to_exact_kernel(const Double_kernel::Point_3& geo) {
+  return Point_3(geo.x(), geo.y(), geo.z());
+}
+
+// Coordinates given directly from R, either as a numeric matrix with a column
+// per dimension or as a list of numeric vectors (e.g. a data frame). The
+// columns are read in place so the only copy made is into the returned points
+inline bool is_coordinate_input(SEXP geo) {
+  return Rf_isMatrix(geo) || Rf_inherits(geo, "data.frame");
+}
+template<typename P>
+inline P point_from_columns(const double* const* columns, size_t i, std::integral_constant<int, 2>) {
+  return P(columns[0][i], columns[1][i]);
+}
+template<typename P>
+inline P point_from_columns(const double* const* columns, size_t i, std::integral_constant<int, 3>) {
+  return P(columns[0][i], columns[1][i], columns[2][i]);
+}
+template<typename P, int dim>
+inline std::vector<P> get_coordinate_vec(SEXP coords) {
+  const double* columns[dim];
+  size_t n;
+  if (TYPEOF(coords) == VECSXP) {
+    if (Rf_xlength(coords) != dim) {
+      cpp11::stop("Coordinates must be given for %i dimensions", dim);
+    }
+    n = Rf_xlength(VECTOR_ELT(coords, 0));
+    for (int d = 0; d < dim; ++d) {
+      SEXP column = VECTOR_ELT(coords, d);
+      if (TYPEOF(column) != REALSXP || (size_t) Rf_xlength(column) != n) {
+        cpp11::stop("Coordinates must be double vectors of equal length");
+      }
+      columns[d] = REAL(column);
+    }
+  } else {
+    if (TYPEOF(coords) != REALSXP || Rf_ncols(coords) != dim) {
+      cpp11::stop("Coordinates must be a double matrix with %i columns", dim);
+    }
+    n = Rf_nrows(coords);
+    for (int d = 0; d < dim; ++d) {
+      columns[d] = REAL(coords) + d * n;
+    }
+  }
+  std::vector<P> res;
+  res.reserve(n);
+  for (size_t i = 0; i < n; ++i) {
+    res.push_back(point_from_columns<P>(columns, i, std::integral_constant<int, dim>()));
+  }
+  return res;
+}
+
+// Queries are given as euclid geometries and converted to the kernel of the
+// tree. Point queries can also be given as coordinates
+template<typename T>
+inline std::vector<T> get_query_vec(SEXP geo) {
+  return get_euclid_vec<T>(geo);
+}
+template<>
+inline std::vector<Point_2> get_query_vec(SEXP geo) {
+  if (is_coordinate_input(geo)) return get_coordinate_vec<Point_2, 2>(geo);
+  return get_euclid_vec<Point_2>(geo);
+}
+template<>
+inline std::vector<Point_3> get_query_vec(SEXP geo) {
+  if (is_coordinate_input(geo)) return get_coordinate_vec<Point_3, 3>(geo);
+  return get_euclid_vec<Point_3>(geo);
+}
+template<typename T>
+inline std::vector<decltype(to_double_kernel(std::declval<T>()))> get_double_query_vec(SEXP geo) {
+  std::vector<T> exact = get_euclid_vec<T>(geo);
+  std::vector<decltype(to_double_kernel(std::declval<T>()))> res;
+  res.reserve(exact.size());
+  for (auto iter = exact.begin(); iter != exact.end(); iter++) {
+    res.push_back(to_double_kernel(*iter));
+  }
+  return res;
+}
+template<>
+inline std::vector<Double_kernel::Point_2> get_query_vec(SEXP geo) {
+  if (is_coordinate_input(geo)) return get_coordinate_vec<Double_kernel::Point_2, 2>(geo);
+  return get_double_query_vec<Point_2>(geo);
+}
+template<>
+inline std::vector<Double_kernel::Point_3> get_query_vec(SEXP geo) {
+  if (is_coordinate_input(geo)) return get_coordinate_vec<Double_kernel::Point_3, 3>(geo);
+  return get_double_query_vec<Point_3>(geo);
+}
+template<>
+inline std::vector<Double_kernel::Circle_2> get_query_vec(SEXP geo) {
+  return get_double_query_vec<Circle_2>(geo);
+}
+template<>
+inline std::vector<Double_kernel::Sphere_3> get_query_vec(SEXP geo) {
+  return get_double_query_vec<Sphere>(geo);
+}
+template<>
+inline std::vector<Double_kernel::Iso_rectangle_2> get_query_vec(SEXP geo) {
+  return get_double_query_vec<Iso_rectangle>(geo);
+}
+template<>
+inline std::vector<Double_kernel::Iso_cuboid_3> get_query_vec(SEXP geo) {
+  return get_double_query_vec<Iso_cuboid>(geo);
+}
+
+// Exact trees are build from euclid points while double precision trees are
+// build directly from coordinates
+template<typename T>
+inline std::vector<T> get_point_vec(SEXP points) {
+  return get_euclid_vec<T>(points);
+}
+template<>
+inline std::vector<Double_kernel::Point_2> get_point_vec(SEXP points) {
+  return get_coordinate_vec<Double_kernel::Point_2, 2>(points);
+}
+template<>
+inline std::vector<Double_kernel::Point_3> get_point_vec(SEXP points) {
+  return get_coordinate_vec<Double_kernel::Point_3, 3>(points);
+}
+
+template<typename FT>
+inline std::vector<FT> get_ft_vec(SEXP num) {
+  return euclid::get_exact_numeric_vec(num);
+}
+template<>
+inline std::vector<double> get_ft_vec(SEXP num) {
+  std::vector<Exact_number> exact = euclid::get_exact_numeric_vec(num);
+  std::vector<double> res;
+  res.reserve(exact.size());
+  for (auto iter = exact.begin(); iter != exact.end(); iter++) {
+    res.push_back(CGAL::to_double(*iter));
+  }
+  return res;
+}
+
+// Fuzzy spheres are defined by their radius rather than the squared radius
+inline Exact_number radius_from_squared(const Exact_number& squared_radius) {
+  return Exact_number(CGAL::sqrt(CGAL::to_double(squared_radius.exact())));
+}
+inline double radius_from_squared(double squared_radius) {
+  return std::sqrt(squared_radius);
+}
+
+// Traversal counters for a single query
+struct query_stats {
+  int nodes = 0;
+  int leaves = 0;
+  int distances = 0;
+};
+
+// Exposes the traversal counters CGAL keeps during a neighbor search
+template<typename S>
+class instrumented_search : public S {
+public:
+  using S::S;
+
+  query_stats stats() const {
+    query_stats res;
+    res.nodes = this->number_of_internal_nodes_visited + this->number_of_leaf_nodes_visited;
+    res.leaves = this->number_of_leaf_nodes_visited;
+    res.distances = this->number_of_items_visited;
+    return res;
+  }
+};
+
+// Property map used to index the tree by the position of each point in the
+// input rather than by copies of the points themselves
+template<typename Point>
+class point_index_map {
+  const std::vector<Point>* _points;
+
+public:
+  typedef size_t key_type;
+  typedef Point value_type;
+  typedef const Point& reference;
+  typedef boost::readable_property_map_tag category;
+
+  point_index_map(const std::vector<Point>* points = nullptr) : _points(points) {}
+
+  friend reference get(const point_index_map& map, key_type i) {
+    return (*map._points)[i];
+  }
+};
+
+// Storage of the hits from a chunk of queries. Each hit is identified by a key
+// that the tree knows how to convert to an input index or a point
+struct hit_buffer {
+  std::vector<size_t> index;
+  std::vector<int> id;
+  std::vector<double> distance;
+};
+
+// Scratch storage shared by the queries of a chunk, which are all answered on
+// the same thread. The buffers are cleared rather than freed between queries
+// so a chunk only allocates until they have grown to fit its largest query
+template<typename FT>
+struct search_context {
+  // Candidates of a neighbor search, kept as a heap on the distance
+  std::vector< std::pair<FT, size_t> > heap;
+  // Neighbors of a query, merged with the buffered points before reporting
+  std::vector< std::pair<size_t, FT> > hits;
+  // Points collected from a subtree
+  std::vector<size_t> keys;
+};
+
+// Summary of the weights of a set of points. Points in unweighted trees have a
+// weight of 1
+struct weight_summary {
+  size_t count = 0;
+  double sum = 0.0;
+  double min = std::numeric_limits<double>::infinity();
+  double max = -std::numeric_limits<double>::infinity();
+
+  void add(double weight) {
+    count++;
+    sum += weight;
+    min = std::min(min, weight);
+    max = std::max(max, weight);
+  }
+  void add(const weight_summary& other) {
+    count += other.count;
+    sum += other.sum;
+    min = std::min(min, other.min);
+    max = std::max(max, other.max);
+  }
+};
+
+// Limit on the number of leaves a single neighbor search may visit. Once it is
+// spent the remaining nodes are skipped and the search returns the best
+// candidates found so far
+struct leaf_budget {
+  size_t leaves;
+  bool exact;
+
+  leaf_budget(double max_leaves) : leaves(std::isinf(max_leaves) ? std::numeric_limits<size_t>::max() : size_t(max_leaves)), exact(true) {}
+
+  // Checked before visiting a node. A node skipped because the budget is spent
+  // makes the search inexact
+  bool available() {
+    if (leaves == 0) {
+      exact = false;
+      return false;
+    }
+    return true;
+  }
+  void spend() { leaves--; }
+};
+
+// The exact number type is not safe to share between threads so exact trees
+// are always queried on the main thread
+template<typename K>
+inline size_t query_threads(int threads) {
+  if (!std::is_same<K, Double_kernel>::value || threads < 1) {
+    return 1;
+  }
+  return threads;
+}
+
+// The location of a query used when ordering queries spatially
+template<typename K>
+inline void query_center(const CGAL::Point_2<K>& q, double* c) {
+  c[0] = CGAL::to_double(q.x());
+  c[1] = CGAL::to_double(q.y());
+}
+template<typename K>
+inline void query_center(const CGAL::Point_3<K>& q, double* c) {
+  c[0] = CGAL::to_double(q.x());
+  c[1] = CGAL::to_double(q.y());
+  c[2] = CGAL::to_double(q.z());
+}
+template<typename K>
+inline void query_center(const CGAL::Circle_2<K>& q, double* c) {
+  query_center(q.center(), c);
+}
+template<typename K>
+inline void query_center(const CGAL::Sphere_3<K>& q, double* c) {
+  query_center(q.center(), c);
+}
+template<typename K>
+inline void query_center(const CGAL::Iso_rectangle_2<K>& q, double* c) {
+  double high[2];
+  query_center(q.min(), c);
+  query_center(q.max(), high);
+  for (size_t d = 0; d < 2; ++d) c[d] = (c[d] + high[d]) / 2.0;
+}
+template<typename K>
+inline void query_center(const CGAL::Iso_cuboid_3<K>& q, double* c) {
+  double high[3];
+  query_center(q.min(), c);
+  query_center(q.max(), high);
+  for (size_t d = 0; d < 3; ++d) c[d] = (c[d] + high[d]) / 2.0;
+}
+
+// Orders a batch of queries along a Morton curve through their centers so that
+// queries answered one after another visit the same parts of the tree. The
+// centers are quantized to a 2^21 grid over their bounding box and the bits of
+// the grid coordinates are interleaved to form the sort key
+template<typename Q>
+std::vector<size_t> morton_order(const std::vector<Q>& queries, size_t dim) {
+  const size_t bits = 21;
+  size_t n = queries.size();
+  std::vector<double> centers(n * dim);
+  double low[3], high[3];
+  for (size_t d = 0; d < dim; ++d) {
+    low[d] = std::numeric_limits<double>::infinity();
+    high[d] = -std::numeric_limits<double>::infinity();
+  }
+  for (size_t i = 0; i < n; ++i) {
+    double* c = centers.data() + i * dim;
+    query_center(queries[i], c);
+    for (size_t d = 0; d < dim; ++d) {
+      low[d] = std::min(low[d], c[d]);
+      high[d] = std::max(high[d], c[d]);
+    }
+  }
+  std::vector< std::pair<uint64_t, size_t> > keys(n);
+  for (size_t i = 0; i < n; ++i) {
+    uint64_t key = 0;
+    for (size_t d = 0; d < dim; ++d) {
+      double extent = high[d] - low[d];
+      double scaled = extent > 0 ? (centers[i * dim + d] - low[d]) / extent : 0.0;
+      uint64_t cell = std::isfinite(scaled) ? uint64_t(scaled * ((1 << bits) - 1)) : 0;
+      for (size_t b = 0; b < bits; ++b) {
+        key |= ((cell >> b) & uint64_t(1)) << (b * dim + d);
+      }
+    }
+    keys[i] = std::make_pair(key, i);
+  }
+  std::sort(keys.begin(), keys.end());
+  std::vector<size_t> order(n);
+  for (size_t i = 0; i < n; ++i) {
+    order[i] = keys[i].second;
+  }
+  return order;
+}
+
+// Gathers the hits of queries answered out of order back into query order with
+// a counting sort on the query id. The sort is stable so the hits of each query
+// keep their order
+inline void restore_query_order(std::vector<hit_buffer>& buffers, size_t n_queries) {
+  std::vector<size_t> offset(n_queries + 1, 0);
+  size_t total = 0;
+  bool distance = false;
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    for (auto id = iter->id.begin(); id != iter->id.end(); id++) {
+      offset[*id]++;
+    }
+    total += iter->id.size();
+    distance = distance || !iter->distance.empty();
+  }
+  for (size_t i = 1; i <= n_queries; ++i) {
+    offset[i] += offset[i - 1];
+  }
+  hit_buffer ordered;
+  ordered.index.resize(total);
+  ordered.id.resize(total);
+  if (distance) ordered.distance.resize(total);
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    for (size_t j = 0; j < iter->id.size(); ++j) {
+      size_t to = offset[iter->id[j] - 1]++;
+      ordered.index[to] = iter->index[j];
+      ordered.id[to] = iter->id[j];
+      if (distance) ordered.distance[to] = iter->distance[j];
+    }
+  }
+  buffers.clear();
+  buffers.push_back(std::move(ordered));
+}
+
+// Combines the hits of a union range search into a single buffer holding each
+// point once. Buffers are merged in chunk order so a point keeps the first
+// query that found it, and points are ordered by their position in the input
+template<typename F>
+inline void merge_union_hits(std::vector<hit_buffer>& buffers, size_t n_keys, F input_index) {
+  std::vector<bool> seen(n_keys, false);
+  hit_buffer merged;
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    for (size_t j = 0; j < iter->index.size(); ++j) {
+      if (seen[iter->index[j]]) continue;
+      seen[iter->index[j]] = true;
+      merged.index.push_back(iter->index[j]);
+      merged.id.push_back(iter->id[j]);
+    }
+  }
+  std::vector<size_t> order(merged.index.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return input_index(merged.index[a]) < input_index(merged.index[b]);
+  });
+  hit_buffer sorted;
+  sorted.index.reserve(order.size());
+  sorted.id.reserve(order.size());
+  for (auto iter = order.begin(); iter != order.end(); iter++) {
+    sorted.index.push_back(merged.index[*iter]);
+    sorted.id.push_back(merged.id[*iter]);
+  }
+  buffers.clear();
+  buffers.push_back(std::move(sorted));
+}
+
+// Assembles the hits from all buffers into the final result. The total number
+// of hits is counted first so that each R vector is allocated once at its final
+// size and filled in bulk
+template<typename I, typename P>
+cpp11::writable::list assemble_result(const std::vector<hit_buffer>& buffers, bool index, bool distance, I get_index, P get_point) {
+  typedef typename std::decay<decltype(get_point(0))>::type Point;
+  size_t total = 0;
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    total += iter->index.size();
+  }
+  cpp11::writable::integers ids(total);
+  int* ids_p = INTEGER(ids);
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    ids_p = std::copy(iter->id.begin(), iter->id.end(), ids_p);
+  }
+  cpp11::sexp located;
+  if (index) {
+    cpp11::writable::integers idx(total);
+    int* idx_p = INTEGER(idx);
+    for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+      for (auto iter_i = iter->index.begin(); iter_i != iter->index.end(); iter_i++) {
+        *(idx_p++) = get_index(*iter_i) + 1;
+      }
+    }
+    located = SEXP(idx);
+  } else {
+    std::vector<Point> pts;
+    pts.reserve(total);
+    for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+      for (auto iter_i = iter->index.begin(); iter_i != iter->index.end(); iter_i++) {
+        pts.push_back(get_point(*iter_i));
+      }
+    }
+    located = create_euclid_vec(pts);
+  }
+  if (!distance) {
+    return cpp11::writable::list({
+      cpp11::named_arg(index ? "index" : "points") = located,
+      "id"_nm = ids
+    });
+  }
+  cpp11::writable::doubles distances(total);
+  double* dist_p = REAL(distances);
+  for (auto iter = buffers.begin(); iter != buffers.end(); iter++) {
+    dist_p = std::copy(iter->distance.begin(), iter->distance.end(), dist_p);
+  }
+  return cpp11::writable::list({
+    cpp11::named_arg(index ? "index" : "points") = located,
+    "id"_nm = ids,
+    "distance"_nm = distances
+  });
+}
+
+// Stats are returned as a data frame with a row per query
+inline SEXP assemble_stats(const std::vector<query_stats>& stats) {
+  size_t n = stats.size();
+  cpp11::writable::integers id(n), nodes(n), leaves(n), distances(n);
+  for (size_t i = 0; i < n; ++i) {
+    id[i] = i + 1;
+    nodes[i] = stats[i].nodes;
+    leaves[i] = stats[i].leaves;
+    distances[i] = stats[i].distances;
+  }
+  cpp11::writable::list res({
+    "id"_nm = id,
+    "nodes"_nm = nodes,
+    "leaves"_nm = leaves,
+    "distances"_nm = distances
+  });
+  res.attr("class") = "data.frame";
+  res.attr("row.names") = {NA_INTEGER, -int(n)};
+  return res;
+}
+
+// The k nearest neighbor graph of the points in a flat image, as an edge list
+// data frame ordered by the input index of the points and then by distance
+template<size_t dim>
+inline SEXP assemble_knn_graph(const flat_view<dim>& tree, size_t k, int threads) {
+  flat_knn_graph<dim> graph(tree, k);
+  graph.run(query_threads<Double_kernel>(threads));
+  size_t n = tree.size();
+  std::vector< std::pair<uint64_t, size_t> > order;
+  order.reserve(n);
+  size_t n_edges = 0;
+  for (size_t j = 0; j < n; ++j) {
+    order.emplace_back(tree.index[j], j);
+    n_edges += graph.n_neighbors(j);
+  }
+  std::sort(order.begin(), order.end());
+  cpp11::writable::integers from(n_edges), to(n_edges);
+  cpp11::writable::doubles distance(n_edges);
+  int* from_p = INTEGER(from);
+  int* to_p = INTEGER(to);
+  double* distance_p = REAL(distance);
+  size_t e = 0;
+  for (auto iter = order.begin(); iter != order.end(); iter++) {
+    const typename flat_knn_graph<dim>::Hit* neighbors = graph.neighbors(iter->second);
+    for (size_t l = 0; l < graph.n_neighbors(iter->second); ++l, ++e) {
+      from_p[e] = iter->first + 1;
+      to_p[e] = tree.index[neighbors[l].second] + 1;
+      distance_p[e] = neighbors[l].first;
+    }
+  }
+  cpp11::writable::list res({
+    "from"_nm = from,
+    "to"_nm = to,
+    "distance"_nm = distance
+  });
+  res.attr("class") = "data.frame";
+  res.attr("row.names") = {NA_INTEGER, -int(n_edges)};
+  return res;
+}
+inline SEXP assemble_knn_graph(const flat_image_ref& image, size_t k, int threads) {
+  const flat_header* header = flat_image_header(image.data());
+  if (header->dim == 2) {
+    return assemble_knn_graph(flat_view<2>(image.data()), k, threads);
+  }
+  return assemble_knn_graph(flat_view<3>(image.data()), k, threads);
+}
+
+// The pairs of points from two flat images within a radius of each other, as a
+// data frame of input indices. The pairs found by each thread are concatenated
+// so their order is unspecified
+template<size_t dim>
+inline SEXP assemble_join(const flat_view<dim>& a, const flat_view<dim>& b, double r, double eps, int threads) {
+  flat_join<dim> join(a, b, r, eps);
+  std::vector< std::vector<typename flat_join<dim>::Pair> > pairs = join.run(query_threads<Double_kernel>(threads));
+  size_t n_pairs = 0;
+  for (auto iter = pairs.begin(); iter != pairs.end(); iter++) {
+    n_pairs += iter->size();
+  }
+  cpp11::writable::integers a_index(n_pairs), b_index(n_pairs);
+  int* a_p = INTEGER(a_index);
+  int* b_p = INTEGER(b_index);
+  size_t e = 0;
+  for (auto iter = pairs.begin(); iter != pairs.end(); iter++) {
+    for (auto pair = iter->begin(); pair != iter->end(); pair++, ++e) {
+      a_p[e] = a.index[pair->first] + 1;
+      b_p[e] = b.index[pair->second] + 1;
+    }
+  }
+  cpp11::writable::list res({
+    "a"_nm = a_index,
+    "b"_nm = b_index
+  });
+  res.attr("class") = "data.frame";
+  res.attr("row.names") = {NA_INTEGER, -int(n_pairs)};
+  return res;
+}
+inline SEXP assemble_join(const flat_image_ref& a, const flat_image_ref& b, double r, double eps, int threads) {
+  const flat_header* header_a = flat_image_header(a.data());
+  const flat_header* header_b = flat_image_header(b.data());
+  if (header_a->dim != header_b->dim) {
+    cpp11::stop("Trees must have the same dimensionality");
+  }
+  if (header_a->dim == 2) {
+    return assemble_join(flat_view<2>(a.data()), flat_view<2>(b.data()), r, eps, threads);
+  }
+  return assemble_join(flat_view<3>(a.data()), flat_view<3>(b.data()), r, eps, threads);
+}
+
+// Summary of the shape of a built tree. The leaf occupancy holds the number of
+// leaves containing 0, 1, 2, ... points
+inline cpp11::writable::list assemble_shape(size_t depth, double mean_depth, size_t n_internal, const std::vector<int>& occupancy, double memory) {
+  int n_leaves = 0;
+  cpp11::writable::integers leaf_occupancy(occupancy.size());
+  for (size_t i = 0; i < occupancy.size(); ++i) {
+    leaf_occupancy[i] = occupancy[i];
+    n_leaves += occupancy[i];
+  }
+  return cpp11::writable::list({
+    "depth"_nm = int(depth),
+    "mean_leaf_depth"_nm = mean_depth,
+    "internal_nodes"_nm = int(n_internal),
+    "leaves"_nm = n_leaves,
+    "leaf_occupancy"_nm = leaf_occupancy,
+    "memory"_nm = memory
+  });
+}
+
+// Range counts are returned as a logical vector if only the existence of a hit
+// was requested
+inline SEXP assemble_counts(const std::vector<size_t>& counts, bool any) {
+  if (any) {
+    cpp11::writable::logicals res(counts.size());
+    int* res_p = LOGICAL(res);
+    for (size_t i = 0; i < counts.size(); ++i) {
+      res_p[i] = counts[i] > 0;
+    }
+    return res;
+  }
+  cpp11::writable::integers res(counts.size());
+  int* res_p = INTEGER(res);
+  for (size_t i = 0; i < counts.size(); ++i) {
+    res_p[i] = counts[i];
+  }
+  return res;
+}
+
+// Aggregates are returned as a data frame with a row per query. The mean,
+// minimum, and maximum are missing for queries without any points
+inline SEXP assemble_aggregates(const std::vector<weight_summary>& aggregates) {
+  size_t n = aggregates.size();
+  cpp11::writable::integers count(n);
+  cpp11::writable::doubles sum(n), mean(n), min(n), max(n);
+  for (size_t i = 0; i < n; ++i) {
+    const weight_summary& aggregate = aggregates[i];
+    bool empty = aggregate.count == 0;
+    count[i] = aggregate.count;
+    sum[i] = aggregate.sum;
+    mean[i] = empty ? NA_REAL : aggregate.sum / aggregate.count;
+    min[i] = empty ? NA_REAL : aggregate.min;
+    max[i] = empty ? NA_REAL : aggregate.max;
+  }
+  cpp11::writable::list res({
+    "count"_nm = count,
+    "sum"_nm = sum,
+    "mean"_nm = mean,
+    "min"_nm = min,
+    "max"_nm = max
+  });
+  res.attr("class") = "data.frame";
+  res.attr("row.names") = {NA_INTEGER, -int(n)};
+  return res;
+}
+
+// Flags whether each query was answered within its leaf budget. The flags are
+// stored as chars as they are written from multiple threads
+inline SEXP assemble_exact(const std::vector<char>& exact) {
+  cpp11::writable::logicals res(exact.size());
+  int* res_p = LOGICAL(res);
+  for (size_t i = 0; i < exact.size(); ++i) {
+    res_p[i] = exact[i];
+  }
+  return res;
+}
+
+template<template<class...> class Split, size_t dim, typename K = Kernel>
 class tree : public tree_base {
-  typedef typename std::conditional<dim == 2, Point_2, Point_3>::type Point;
-  typedef typename std::conditional<dim == 2, Circle_2, Sphere>::type Spheroid;
-  typedef typename std::conditional<dim == 2, Iso_rectangle, Iso_cuboid>::type Box;
-  typedef typename std::conditional< dim == 2, CGAL::Search_traits_2<Kernel>, CGAL::Search_traits_3<Kernel> >::type Traits;
-  typedef CGAL::Kd_tree<Traits, Splitter, CGAL::Tag_true> Tree;
+  typedef typename K::FT FT;
+  typedef typename std::conditional<dim == 2, typename K::Point_2, typename K::Point_3>::type Point;
+  typedef typename std::conditional<dim == 2, typename K::Circle_2, typename K::Sphere_3>::type Spheroid;
+  typedef typename std::conditional<dim == 2, typename K::Iso_rectangle_2, typename K::Iso_cuboid_3>::type Box;
+  typedef typename std::conditional<dim == 2, Point_2, Point_3>::type Exact_point;
+  typedef typename std::conditional< dim == 2, CGAL::Search_traits_2<K>, CGAL::Search_traits_3<K> >::type Base_traits;
+  typedef point_index_map<Point> Point_map;
+  typedef CGAL::Search_traits_adapter<size_t, Point_map, Base_traits> Traits;
+  typedef CGAL::Kd_tree_rectangle<FT, typename Base_traits::Dimension> Rectangle;
 
 protected:
-  Tree _tree;
+  typedef Split<Traits> Splitter;
+  typedef CGAL::Kd_tree<Traits, Splitter, CGAL::Tag_true> Tree;
+  typedef typename Tree::Node_const_handle Node_handle;
+
+  // The number and weights of the points below a node. Summaries are stored in
+  // preorder along with the handle of their node and the position of the
+  // summaries of its children so traversals step through them together with
+  // the tree
+  struct node_summary {
+    Node_handle node;
+    weight_summary weights;
+    size_t lower;
+    size_t upper;
+  };
+
+  // Points are never erased from _points so that the index of a point stays
+  // the same for the lifetime of the tree. Inserted points are kept in a side
+  // buffer that queries scan alongside the tree and removed points are marked
+  // in _removed. Both are folded into a new tree once they grow too large
+  std::vector<Point> _points;
+  std::unique_ptr<Tree> _tree;
+  // CGAL keeps counting points removed from the tree in its size() so the
+  // number of points left in it is tracked here
+  size_t _n_in_tree;
+  std::vector<size_t> _buffer;
+  // The position of each buffered point in _buffer so it can be dropped from
+  // the buffer without searching it
+  std::unordered_map<size_t, size_t> _buffer_pos;
+  std::vector<bool> _removed;
+  size_t _n_removed;
+  size_t _n_changed;
+  // Bumped whenever points are inserted or removed or the tree is rebuilt, so
+  // cursors can tell that the tree they traverse has changed
+  size_t _revision;
+  // The weight of each point, empty for unweighted trees
+  std::vector<double> _weights;
+  // The tree in the flat layout as of _flat_revision, kept for repeated
+  // dual-tree traversals and saves of an unchanged tree
+  std::shared_ptr<const std::vector<char>> _flat;
+  size_t _flat_revision;
+  // Summaries of the nodes, used to count and aggregate whole subtrees
+  std::vector<node_summary> _summaries;
+  size_t _root_summary;
   size_t _bucket;
   double _aspect;
+  size_t _threads;
   virtual Splitter create_splitter(size_t bucket, double aspect) {
     return Splitter(bucket);
   }
 
 public:
-  tree(SEXP points, size_t bucket, double aspect) : _tree(create_splitter(bucket, aspect)), _bucket(bucket), _aspect(aspect) {
-    std::vector<Point> p = get_euclid_vec<Point>(points);
-    _tree.insert(p.begin(), p.end());
-    _tree.build();
-  }
+  tree(SEXP points, size_t bucket, double aspect, int threads = 1) : _points(get_point_vec<Point>(points)), _n_in_tree(_points.size()), _removed(_points.size(), false), _n_removed(0), _n_changed(0), _revision(0), _flat_revision(0), _bucket(bucket), _aspect(aspect), _threads(query_threads<K>(threads)) {}
   ~tree() = default;
 
+  // Builds the tree of the initial points. The splitter of a subclass is not
+  // available while the base is being constructed, so this is called by the
+  // factories once the tree is complete
+  void build() {
+    _tree.reset(new Tree(create_splitter(_bucket, _aspect), Traits(Point_map(&_points))));
+    _tree->insert(boost::counting_iterator<size_t>(0), boost::counting_iterator<size_t>(_points.size()));
+    build_tree(*_tree);
+    update_summaries();
+  }
+
   size_t dimension() const { return dim; }
+  std::string precision() const { return std::is_same<K, Double_kernel>::value ? "double" : "exact"; }
 
-  size_t size() const { return _tree.size(); }
+  size_t size() const { return _points.size() - _n_removed; }
   size_t bucket_size() const { return _bucket; }
   double aspect_ratio() const { return _aspect; }
+  std::string engine() const { return "cgal"; }
+  bool weighted() const { return !_weights.empty(); }
   SEXP points() const {
-    std::vector<Point> res(_tree.begin(), _tree.end());
+    std::vector<Exact_point> res;
+    res.reserve(size());
+    for (size_t i = 0; i < _points.size(); ++i) {
+      if (!_removed[i]) res.push_back(to_exact_kernel(_points[i]));
+    }
     return create_euclid_vec(res);
   }
   SEXP bbox() const {
     if (dim == 2) {
       std::vector<Iso_rectangle> ir;
-      ir.emplace_back(Point_2(_tree.bounding_box().min_coord(0), _tree.bounding_box().min_coord(1)),
-                      Point_2(_tree.bounding_box().max_coord(0), _tree.bounding_box().max_coord(1)));
+      ir.emplace_back(Point_2(Exact_number(_tree->bounding_box().min_coord(0)), Exact_number(_tree->bounding_box().min_coord(1))),
+                      Point_2(Exact_number(_tree->bounding_box().max_coord(0)), Exact_number(_tree->bounding_box().max_coord(1))));
       return create_euclid_vec(ir);
     } else {
       std::vector<Iso_cuboid> ic;
-      ic.emplace_back(Point_3(_tree.bounding_box().min_coord(0), _tree.bounding_box().min_coord(1), _tree.bounding_box().min_coord(2)),
-                      Point_3(_tree.bounding_box().max_coord(0), _tree.bounding_box().max_coord(1), _tree.bounding_box().max_coord(2)));
+      ic.emplace_back(Point_3(Exact_number(_tree->bounding_box().min_coord(0)), Exact_number(_tree->bounding_box().min_coord(1)), Exact_number(_tree->bounding_box().min_coord(2))),
+                      Point_3(Exact_number(_tree->bounding_box().max_coord(0)), Exact_number(_tree->bounding_box().max_coord(1)), Exact_number(_tree->bounding_box().max_coord(2))));
       return create_euclid_vec(ic);
     }
   }
 
-  //SEXP point_search(SEXP points, size_t n, Exact_number eps, bool nearest, bool sort, bool minkowski, double p, cpp11::doubles w) const {
-  //  std::vector<Point> pts = get_euclid_vec<Point>(points);
-  //  if (minkowski) {
-  //    if (dim != w.size()) {
-  //      cpp11::stop("A weight for each dimension must be given");
-  //    }
-  //    typedef CGAL::Weighted_Minkowski_distance<Traits> Dist;
-  //    typedef CGAL::Orthogonal_k_neighbor_search<Traits, Dist, Splitter, Tree> Search;
-  //    Dist dist(p, dim, w.begin(), w.end());
-  //    return search_impl<Point, Dist, Search>(pts, n, dist, eps, nearest, sort);
-  //  } else {
-  //    typedef CGAL::Euclidean_distance<Traits> Dist;
-  //    typedef CGAL::Orthogonal_k_neighbor_search<Traits, Dist, Splitter, Tree> Search;
-  //    Dist dist;
-  //    return search_impl<Point, Dist, Search>(pts, n, dist, eps, nearest, sort);
-  //  }
-  //}
-
-  cpp11::writable::list point_search(SEXP points, cpp11::integers n, SEXP eps, bool nearest, bool sort) const {
-    typedef CGAL::Euclidean_distance<Traits> Dist;
-    typedef CGAL::Orthogonal_k_neighbor_search<Traits, Dist, Splitter, Tree> Search;
-    std::vector<Point> pts = get_euclid_vec<Point>(points);
-    Dist dist;
-    return search_impl<Point, Dist, Search>(pts, n, dist, eps, nearest, sort);
-  }
-
-  cpp11::writable::list spheroid_search(SEXP spheroids, cpp11::integers n, SEXP eps, bool nearest, bool sort) const {
-    typedef CGAL::Euclidean_distance_sphere_point<Traits> Dist;
+  // Memory is estimated from the size of the point and node types. Memory
+  // held by the representation of exact numbers is not included
+  cpp11::writable::list shape() const {
+    size_t depth = 0;
+    size_t n_internal = 0;
+    double depth_sum = 0.0;
+    std::vector<int> occupancy;
+    if (_n_in_tree != 0) {
+      std::vector< std::pair<Node_handle, size_t> > stack;
+      stack.emplace_back(_tree->root(), 0);
+      while (!stack.empty()) {
+        std::pair<Node_handle, size_t> next = stack.back();
+        stack.pop_back();
+        if (next.first->is_leaf()) {
+          size_t n = static_cast<typename Tree::Leaf_node_const_handle>(next.first)->size();
+          if (occupancy.size() <= n) occupancy.resize(n + 1, 0);
+          occupancy[n]++;
+          depth = std::max(depth, next.second);
+          depth_sum += next.second;
+        } else {
+          typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(next.first);
+          n_internal++;
+          stack.emplace_back(internal->lower(), next.second + 1);
+          stack.emplace_back(internal->upper(), next.second + 1);
+        }
+      }
+    }
+    size_t n_leaves = 0;
+    for (auto iter = occupancy.begin(); iter != occupancy.end(); iter++) {
+      n_leaves += *iter;
+    }
+    double memory = _points.capacity() * sizeof(Point) +
+      _n_in_tree * (sizeof(size_t) + sizeof(const size_t*)) +
+      n_internal * sizeof(typename Tree::Internal_node) +
+      n_leaves * sizeof(typename Tree::Leaf_node) +
+      _buffer.capacity() * sizeof(size_t) +
+      _buffer_pos.size() * (2 * sizeof(size_t) + sizeof(void*)) +
+      _removed.capacity() / 8 +
+      _weights.capacity() * sizeof(double) +
+      (_flat ? _flat->capacity() : 0) +
+      _summaries.capacity() * sizeof(node_summary);
+    return assemble_shape(depth, n_leaves == 0 ? 0.0 : depth_sum / n_leaves, n_internal, occupancy, memory);
+  }
+
+  cpp11::writable::list point_search(SEXP points, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder, std::string metric, double p, cpp11::doubles weights) const {
+    std::vector<Point> pts = get_query_vec<Point>(points);
+    std::vector<double> w(weights.begin(), weights.end());
+    return dispatch_metric(metric, p, w, dim, [&](auto m) {
+      typedef point_distance<Base_traits, decltype(m)> Metric_distance;
+      typedef CGAL::Distance_adapter<size_t, Point_map, typename Metric_distance::type> Dist;
+      typedef CGAL::Orthogonal_k_neighbor_search<Traits, Dist, Splitter, Tree> Search;
+      Point_map pmap(&_points);
+      Dist dist(pmap, Metric_distance::create(m));
+      return search_impl<Point, Dist, Search>(pts, n, dist, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
+    });
+  }
+
+  cpp11::writable::list spheroid_search(SEXP spheroids, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const {
+    typedef CGAL::Distance_adapter<size_t, Point_map, CGAL::Euclidean_distance_sphere_point<Base_traits> > Dist;
     typedef CGAL::K_neighbor_search<Traits, Dist, Splitter, Tree> Search;
-    std::vector<Spheroid> sph = get_euclid_vec<Spheroid>(spheroids);
-    Dist dist;
-    return search_impl<Spheroid, Dist, Search>(sph, n, dist, eps, nearest, sort);
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    Point_map pmap(&_points);
+    Dist dist(pmap);
+    return search_impl<Spheroid, Dist, Search>(sph, n, dist, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
   }
 
-  cpp11::writable::list box_search(SEXP boxes, cpp11::integers n, SEXP eps, bool nearest, bool sort) const {
-    typedef CGAL::Manhattan_distance_iso_box_point<Traits> Dist;
+  cpp11::writable::list box_search(SEXP boxes, cpp11::integers n, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const {
+    typedef CGAL::Distance_adapter<size_t, Point_map, CGAL::Manhattan_distance_iso_box_point<Base_traits> > Dist;
     typedef CGAL::K_neighbor_search<Traits, Dist, Splitter, Tree> Search;
-    std::vector<Box> box = get_euclid_vec<Box>(boxes);
-    Dist dist;
-    return search_impl<Box, Dist, Search>(box, n, dist, eps, nearest, sort);
-  }
-
-  cpp11::writable::list spheroid_range(SEXP spheroids, SEXP eps) const {
-    std::vector<Spheroid> sph = get_euclid_vec<Spheroid>(spheroids);
-    std::vector<Exact_number> eps_vec = euclid::get_exact_numeric_vec(eps);
-    std::vector<Point> res;
-    cpp11::writable::integers ids;
-    for (size_t i = 0; i < sph.size(); ++i) {
-      std::vector<Point> temp_res;
-      CGAL::Fuzzy_sphere<Traits> fs(sph[i].center(), Exact_number(CGAL::sqrt(CGAL::to_double(sph[i].squared_radius().exact()))), eps_vec[i % eps_vec.size()]);
-      _tree.search(std::back_inserter(temp_res), fs);
-      for (auto iter = temp_res.begin(); iter != temp_res.end(); iter++) {
-        res.push_back(*iter);
-        ids.push_back(i + 1);
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    Point_map pmap(&_points);
+    Dist dist(pmap);
+    return search_impl<Box, Dist, Search>(box, n, dist, eps, max_distance, max_leaves, nearest, sort, index, stats, threads, reorder);
+  }
+
+  cpp11::writable::list spheroid_range(SEXP spheroids, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    std::vector<size_t> order = reorder ? morton_order(sph, dim) : std::vector<size_t>();
+    return range_impl(sph.size(), order, index, stats, threads, unique, [&](size_t i) {
+      return CGAL::Fuzzy_sphere<Traits>(sph[i].center(), radius_from_squared(sph[i].squared_radius()), eps_vec[i % eps_vec.size()], _tree->traits());
+    });
+  }
+
+  cpp11::writable::list box_range(SEXP boxes, SEXP eps, bool index, bool stats, int threads, bool reorder, bool unique) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    std::vector<size_t> order = reorder ? morton_order(box, dim) : std::vector<size_t>();
+    return range_impl(box.size(), order, index, stats, threads, unique, [&](size_t i) {
+      return CGAL::Fuzzy_iso_box<Traits>(box[i].min(), box[i].max(), eps_vec[i % eps_vec.size()], _tree->traits());
+    });
+  }
+
+  SEXP spheroid_count(SEXP spheroids, SEXP eps, bool any, int threads) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    return count_impl(sph.size(), any, threads, [&](size_t i) {
+      CGAL::Fuzzy_sphere<Traits> fs(sph[i].center(), radius_from_squared(sph[i].squared_radius()), eps_vec[i % eps_vec.size()], _tree->traits());
+      return count_range(fs, any);
+    });
+  }
+
+  SEXP box_count(SEXP boxes, SEXP eps, bool any, int threads) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    return count_impl(box.size(), any, threads, [&](size_t i) {
+      CGAL::Fuzzy_iso_box<Traits> fb(box[i].min(), box[i].max(), eps_vec[i % eps_vec.size()], _tree->traits());
+      return count_range(fb, any);
+    });
+  }
+
+  SEXP spheroid_aggregate(SEXP spheroids, SEXP eps, int threads) const {
+    std::vector<Spheroid> sph = get_query_vec<Spheroid>(spheroids);
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    return aggregate_impl(sph.size(), threads, [&](size_t i) {
+      CGAL::Fuzzy_sphere<Traits> fs(sph[i].center(), radius_from_squared(sph[i].squared_radius()), eps_vec[i % eps_vec.size()], _tree->traits());
+      return aggregate_range(fs);
+    });
+  }
+
+  SEXP box_aggregate(SEXP boxes, SEXP eps, int threads) const {
+    std::vector<Box> box = get_query_vec<Box>(boxes);
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    return aggregate_impl(box.size(), threads, [&](size_t i) {
+      CGAL::Fuzzy_iso_box<Traits> fb(box[i].min(), box[i].max(), eps_vec[i % eps_vec.size()], _tree->traits());
+      return aggregate_range(fb);
+    });
+  }
+
+  neighbor_cursor* cursor(SEXP point, bool nearest) const {
+    std::vector<Point> pts = get_query_vec<Point>(point);
+    if (pts.size() != 1) {
+      cpp11::stop("A cursor must start from a single point");
+    }
+    return new incremental_cursor(this, pts[0], nearest);
+  }
+
+  // New points are appended to the side buffer and get the next free indices.
+  // Weights must be given for the new points if the tree is weighted and must
+  // not be given otherwise
+  cpp11::writable::integers insert(SEXP points, cpp11::doubles weights) {
+    std::vector<Point> new_points = get_point_vec<Point>(points);
+    if (weighted() && size_t(weights.size()) != new_points.size()) {
+      cpp11::stop("A weight must be given for each new point");
+    }
+    if (!weighted() && weights.size() != 0) {
+      cpp11::stop("Weights can't be given for points inserted into an unweighted tree");
+    }
+    cpp11::writable::integers index(new_points.size());
+    for (size_t i = 0; i < new_points.size(); ++i) {
+      index[i] = _points.size() + 1;
+      _buffer_pos[_points.size()] = _buffer.size();
+      _buffer.push_back(_points.size());
+      _points.push_back(new_points[i]);
+      _removed.push_back(false);
+      if (weighted()) _weights.push_back(weights[i]);
+    }
+    _n_changed += new_points.size();
+    _revision++;
+    rebuild_if_needed();
+    return index;
+  }
+
+  // Points still in the side buffer are dropped from it while points in the
+  // tree are removed from their leaf without rebalancing
+  void remove(cpp11::integers index) {
+    for (auto iter = index.begin(); iter != index.end(); iter++) {
+      if (*iter == NA_INTEGER || *iter < 1 || size_t(*iter) > _points.size()) {
+        cpp11::stop("Index out of bounds");
+      }
+      size_t i = *iter - 1;
+      if (_removed[i]) {
+        continue;
+      }
+      auto buffered = _buffer_pos.find(i);
+      if (buffered != _buffer_pos.end()) {
+        // The last buffered point takes the place of the removed one
+        size_t pos = buffered->second;
+        _buffer_pos.erase(buffered);
+        _buffer[pos] = _buffer.back();
+        _buffer.pop_back();
+        if (pos < _buffer.size()) {
+          _buffer_pos[_buffer[pos]] = pos;
+        }
+      } else {
+        remove_from_tree(i);
       }
+      _removed[i] = true;
+      _n_removed++;
+      _n_changed++;
     }
-    return cpp11::writable::list({
-      "points"_nm = create_euclid_vec(res),
-      "id"_nm = ids
+    _revision++;
+    rebuild_if_needed();
+  }
+
+  // Weights are given for every point ever added to the tree, in index order
+  void set_weights(cpp11::doubles weights) {
+    if (size_t(weights.size()) != _points.size()) {
+      cpp11::stop("A weight must be given for each point");
+    }
+    _weights.assign(weights.begin(), weights.end());
+    _flat.reset();
+    update_summaries();
+  }
+
+  // Converts the tree to the flat layout. Internal nodes are emitted in preorder
+  // with the lower child directly after its parent so the structure of the CGAL
+  // tree is kept as is. Buffered insertions are merged into the leaves of the
+  // cells they fall in so the tree itself is left untouched
+  std::vector<char> flatten() {
+    std::unordered_map<Node_handle, std::vector<size_t>> buffered;
+    if (_n_in_tree != 0) {
+      for (auto iter = _buffer.begin(); iter != _buffer.end(); iter++) {
+        Node_handle node = _tree->root();
+        while (!node->is_leaf()) {
+          typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(node);
+          node = _points[*iter].cartesian(internal->cutting_dimension()) <= internal->cutting_value() ? internal->lower() : internal->upper();
+        }
+        buffered[node].push_back(*iter);
+      }
+    }
+    // Upper children are reached after the full lower subtree has been written
+    // so their parent is patched once their position is known
+    struct pending {
+      Node_handle node;
+      size_t parent;
+      bool upper;
+    };
+    flat_builder builder(dim, split_type(), _bucket, _aspect, weighted());
+    double coords[dim];
+    auto add_point = [&](size_t i) {
+      for (size_t d = 0; d < dim; ++d) {
+        coords[d] = CGAL::to_double(_points[i].cartesian(d));
+      }
+      builder.add_point(i, coords, weight(i));
+    };
+    if (_n_in_tree != 0) {
+      std::vector<pending> stack;
+      stack.push_back({_tree->root(), 0, false});
+      while (!stack.empty()) {
+        pending next = stack.back();
+        stack.pop_back();
+        size_t current;
+        if (next.node->is_leaf()) {
+          typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(next.node);
+          current = builder.add_leaf();
+          for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+            add_point(*iter);
+          }
+          auto extra = buffered.find(next.node);
+          if (extra != buffered.end()) {
+            for (auto iter = extra->second.begin(); iter != extra->second.end(); iter++) {
+              add_point(*iter);
+            }
+          }
+        } else {
+          typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(next.node);
+          current = builder.add_internal(internal->cutting_dimension(), CGAL::to_double(internal->cutting_value()));
+          stack.push_back({internal->upper(), current, true});
+          stack.push_back({internal->lower(), current, false});
+        }
+        if (next.upper) {
+          builder.set_upper(next.parent, current);
+        }
+      }
+    } else if (!_buffer.empty()) {
+      // Too few points have been inserted into an empty tree to rebuild it
+      builder.add_leaf();
+      for (auto iter = _buffer.begin(); iter != _buffer.end(); iter++) {
+        add_point(*iter);
+      }
+    }
+    return builder.finish();
+  }
+  // Dual-tree traversals run on a copy of the tree in the flat layout so they
+  // compute distances in double precision for exact trees as well. The copy is
+  // reused until the tree is modified
+  flat_image_ref flat_image() {
+    if (!_flat || _flat_revision != _revision) {
+      _flat = std::make_shared<const std::vector<char>>(flatten());
+      _flat_revision = _revision;
+    }
+    flat_image_ref res;
+    res.storage = _flat;
+    return res;
+  }
+  void save(const std::string& file) {
+    flat_image_ref image = flat_image();
+    write_flat_image(file, image.data(), image.size());
+  }
+
+private:
+  // CGAL builds the top levels of the tree on the calling thread and the
+  // resulting subtrees concurrently using TBB. The arena caps the number of
+  // workers used. Without TBB the tree is always built sequentially
+  void build_tree(Tree& tree) const {
+#ifdef CGAL_LINKED_WITH_TBB
+    if (_threads > 1) {
+      tbb::task_arena arena(_threads);
+      arena.execute([&]() {
+        tree.template build<CGAL::Parallel_tag>();
+      });
+      return;
+    }
+#endif
+    tree.build();
+  }
+
+  // Rebuilding is amortized by waiting until the number of changes since the
+  // last build is a fixed fraction of the tree size. This keeps the side buffer
+  // small enough to scan and the tree from degrading after many removals
+  bool rebuild_if_needed() {
+    if (_n_changed > std::max(size_t(64), size() / 16)) {
+      rebuild();
+      return true;
+    }
+    return false;
+  }
+  void rebuild() {
+    std::unique_ptr<Tree> new_tree(new Tree(create_splitter(_bucket, _aspect), Traits(Point_map(&_points))));
+    for (size_t i = 0; i < _points.size(); ++i) {
+      if (!_removed[i]) new_tree->insert(i);
+    }
+    build_tree(*new_tree);
+    _tree = std::move(new_tree);
+    _n_in_tree = size();
+    _buffer.clear();
+    _buffer_pos.clear();
+    _n_changed = 0;
+    _revision++;
+    update_summaries();
+  }
+
+  void update_summaries() {
+    _summaries.clear();
+    _root_summary = 0;
+    if (_n_in_tree != 0) {
+      summarise_subtree(_tree->root());
+    }
+  }
+  size_t summarise_subtree(Node_handle node) {
+    size_t id = _summaries.size();
+    _summaries.push_back({node, weight_summary(), 0, 0});
+    if (!node->is_leaf()) {
+      typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(node);
+      size_t lower = summarise_subtree(internal->lower());
+      size_t upper = summarise_subtree(internal->upper());
+      _summaries[id].lower = lower;
+      _summaries[id].upper = upper;
+    }
+    refresh_summary(id);
+    return id;
+  }
+  // Points in unweighted trees all have a weight of 1 so their leaves are
+  // summarised without visiting the points
+  void refresh_summary(size_t id) {
+    node_summary& summary = _summaries[id];
+    summary.weights = weight_summary();
+    if (summary.node->is_leaf()) {
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(summary.node);
+      if (!weighted()) {
+        summary.weights.count = leaf->size();
+        summary.weights.sum = leaf->size();
+        if (leaf->size() != 0) {
+          summary.weights.min = 1.0;
+          summary.weights.max = 1.0;
+        }
+        return;
+      }
+      for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+        summary.weights.add(_weights[*iter]);
+      }
+    } else {
+      summary.weights.add(_summaries[summary.lower].weights);
+      summary.weights.add(_summaries[summary.upper].weights);
+    }
+  }
+
+  // Removes a point from its leaf and refreshes the summaries on the path to
+  // it. CGAL splices the parent of a leaf out of the tree when the leaf becomes
+  // empty so the path is linked up with the tree again before refreshing it
+  void remove_from_tree(size_t i) {
+    std::vector<size_t> path;
+    bool found = find_leaf(_root_summary, i, path);
+    _tree->remove(i);
+    _n_in_tree--;
+    if (!found || _n_in_tree == 0) {
+      update_summaries();
+      return;
+    }
+    bool linked = relink_summary(_root_summary, _tree->root());
+    for (size_t k = 0; linked && k + 1 < path.size(); ++k) {
+      node_summary& summary = _summaries[path[k]];
+      typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(summary.node);
+      linked = relink_summary(summary.lower, internal->lower()) && relink_summary(summary.upper, internal->upper());
+    }
+    if (!linked) {
+      update_summaries();
+      return;
+    }
+    for (size_t k = path.size(); k > 0; --k) {
+      refresh_summary(path[k - 1]);
+    }
+  }
+  bool find_leaf(size_t id, size_t i, std::vector<size_t>& path) const {
+    const node_summary& summary = _summaries[id];
+    path.push_back(id);
+    if (summary.node->is_leaf()) {
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(summary.node);
+      if (std::find(leaf->begin(), leaf->end(), i) != leaf->end()) {
+        return true;
+      }
+    } else {
+      typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(summary.node);
+      FT coord = _points[i].cartesian(internal->cutting_dimension());
+      if (coord <= internal->cutting_value() && find_leaf(summary.lower, i, path)) {
+        return true;
+      }
+      if (coord >= internal->cutting_value() && find_leaf(summary.upper, i, path)) {
+        return true;
+      }
+    }
+    path.pop_back();
+    return false;
+  }
+  // A node spliced out of the tree is replaced by the child that took its place
+  bool relink_summary(size_t& id, Node_handle node) const {
+    while (_summaries[id].node != node) {
+      if (_summaries[id].node->is_leaf()) {
+        return false;
+      }
+      id = _summaries[_summaries[id].lower].node == node ? _summaries[id].lower : _summaries[id].upper;
+    }
+    return true;
+  }
+  double weight(size_t i) const {
+    return _weights.empty() ? 1.0 : _weights[i];
+  }
+
+  // Counts the points in range below a node. Subtrees that lie fully inside
+  // the range are counted without visiting their leaves and the traversal
+  // stops at the first hit if only existence is requested
+  template<typename R>
+  size_t count_node(size_t id, const Rectangle& rect, const R& range, bool any) const {
+    const node_summary& summary = _summaries[id];
+    if (range.outer_range_contains(rect)) {
+      return summary.weights.count;
+    }
+    size_t n = 0;
+    if (summary.node->is_leaf()) {
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(summary.node);
+      for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+        if (range.contains(*iter)) {
+          n++;
+          if (any) break;
+        }
+      }
+      return n;
+    }
+    typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(summary.node);
+    Rectangle lower(rect);
+    Rectangle upper(rect);
+    lower.split(upper, internal->cutting_dimension(), internal->cutting_value());
+    if (range.inner_range_intersects(lower)) {
+      n += count_node(summary.lower, lower, range, any);
+    }
+    if (any && n > 0) {
+      return n;
+    }
+    if (range.inner_range_intersects(upper)) {
+      n += count_node(summary.upper, upper, range, any);
+    }
+    return n;
+  }
+  template<typename R>
+  size_t count_range(const R& range, bool any) const {
+    size_t n = 0;
+    for (auto iter = _buffer.begin(); iter != _buffer.end(); iter++) {
+      if (range.contains(*iter)) {
+        n++;
+        if (any) return n;
+      }
+    }
+    if (_n_in_tree != 0 && range.inner_range_intersects(_tree->bounding_box())) {
+      n += count_node(_root_summary, _tree->bounding_box(), range, any);
+    }
+    return n;
+  }
+
+  // Aggregates the weights of the points in range below a node, using the
+  // cached summary of subtrees that lie fully inside the range
+  template<typename R>
+  void aggregate_node(size_t id, const Rectangle& rect, const R& range, weight_summary& res) const {
+    const node_summary& summary = _summaries[id];
+    if (range.outer_range_contains(rect)) {
+      res.add(summary.weights);
+      return;
+    }
+    if (summary.node->is_leaf()) {
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(summary.node);
+      for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+        if (range.contains(*iter)) {
+          res.add(weight(*iter));
+        }
+      }
+      return;
+    }
+    typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(summary.node);
+    Rectangle lower(rect);
+    Rectangle upper(rect);
+    lower.split(upper, internal->cutting_dimension(), internal->cutting_value());
+    if (range.inner_range_intersects(lower)) {
+      aggregate_node(summary.lower, lower, range, res);
+    }
+    if (range.inner_range_intersects(upper)) {
+      aggregate_node(summary.upper, upper, range, res);
+    }
+  }
+  template<typename R>
+  weight_summary aggregate_range(const R& range) const {
+    weight_summary res;
+    for (auto iter = _buffer.begin(); iter != _buffer.end(); iter++) {
+      if (range.contains(*iter)) {
+        res.add(weight(*iter));
+      }
+    }
+    if (_n_in_tree != 0 && range.inner_range_intersects(_tree->bounding_box())) {
+      aggregate_node(_root_summary, _tree->bounding_box(), range, res);
+    }
+    return res;
+  }
+
+  template<typename F>
+  SEXP aggregate_impl(size_t n_queries, int threads, F aggregate) const {
+    size_t n_threads = query_threads<K>(threads);
+    std::vector<chunk> chunks = split_chunks(n_queries, n_threads);
+    std::vector<weight_summary> aggregates(n_queries);
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      for (size_t i = chunks[c].begin; i < chunks[c].end; ++i) {
+        aggregates[i] = aggregate(i);
+      }
     });
+    return assemble_aggregates(aggregates);
   }
 
-  cpp11::writable::list box_range(SEXP boxes, SEXP eps) const {
-    std::vector<Box> box = get_euclid_vec<Box>(boxes);
-    std::vector<Exact_number> eps_vec = euclid::get_exact_numeric_vec(eps);
-    std::vector<Point> res;
-    cpp11::writable::integers ids;
-    for (size_t i = 0; i < box.size(); ++i) {
-      std::vector<Point> temp_res;
-      CGAL::Fuzzy_iso_box<Traits> fb(box[i].min(), box[i].max(), eps_vec[i % eps_vec.size()]);
-      _tree.search(std::back_inserter(temp_res), fb);
-      for (auto iter = temp_res.begin(); iter != temp_res.end(); iter++) {
+  template<typename F>
+  SEXP count_impl(size_t n_queries, bool any, int threads, F count) const {
+    size_t n_threads = query_threads<K>(threads);
+    std::vector<chunk> chunks = split_chunks(n_queries, n_threads);
+    std::vector<size_t> counts(n_queries);
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      for (size_t i = chunks[c].begin; i < chunks[c].end; ++i) {
+        counts[i] = count(i);
+      }
+    });
+    return assemble_counts(counts, any);
+  }
+
+  // Range searches are handed to CGAL unless stats are requested, in which case
+  // an equivalent traversal that records the visited nodes is used
+  template<typename R>
+  void search_range(const R& range, std::vector<size_t>& res, query_stats* stats) const {
+    if (stats == nullptr) {
+      _tree->search(std::back_inserter(res), range);
+    } else if (_n_in_tree != 0 && range.inner_range_intersects(_tree->bounding_box())) {
+      collect_node(_tree->root(), _tree->bounding_box(), range, res, *stats);
+    }
+    for (auto iter = _buffer.begin(); iter != _buffer.end(); iter++) {
+      if (range.contains(*iter)) res.push_back(*iter);
+    }
+    if (stats != nullptr) {
+      stats->distances += _buffer.size();
+    }
+  }
+  template<typename R>
+  void collect_node(Node_handle node, const Rectangle& rect, const R& range, std::vector<size_t>& res, query_stats& stats) const {
+    if (range.outer_range_contains(rect)) {
+      collect_subtree(node, res, stats);
+      return;
+    }
+    stats.nodes++;
+    if (node->is_leaf()) {
+      stats.leaves++;
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(node);
+      for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+        stats.distances++;
+        if (range.contains(*iter)) res.push_back(*iter);
+      }
+      return;
+    }
+    typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(node);
+    Rectangle lower(rect);
+    Rectangle upper(rect);
+    lower.split(upper, internal->cutting_dimension(), internal->cutting_value());
+    if (range.inner_range_intersects(lower)) {
+      collect_node(internal->lower(), lower, range, res, stats);
+    }
+    if (range.inner_range_intersects(upper)) {
+      collect_node(internal->upper(), upper, range, res, stats);
+    }
+  }
+  void collect_subtree(Node_handle node, std::vector<size_t>& res, query_stats& stats) const {
+    stats.nodes++;
+    if (node->is_leaf()) {
+      stats.leaves++;
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(node);
+      res.insert(res.end(), leaf->begin(), leaf->end());
+      return;
+    }
+    typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(node);
+    collect_subtree(internal->lower(), res, stats);
+    collect_subtree(internal->upper(), res, stats);
+  }
+
+  // Marks kept by a chunk of queries in a union range search. A point is only
+  // reported by the first query finding it and nodes whose points are all
+  // marked are skipped by later queries
+  struct union_marks {
+    std::vector<bool> points;
+    std::unordered_set<Node_handle> nodes;
+  };
+  template<typename R>
+  void union_range(const R& range, union_marks& marks, std::vector<size_t>& res, search_context<FT>& context, query_stats& stats) const {
+    if (_n_in_tree != 0) {
+      union_node(_tree->root(), _tree->bounding_box(), range, marks, res, context, stats);
+    }
+    for (auto iter = _buffer.begin(); iter != _buffer.end(); iter++) {
+      if (marks.points[*iter] || !range.contains(*iter)) continue;
+      marks.points[*iter] = true;
+      res.push_back(*iter);
+    }
+    stats.distances += _buffer.size();
+  }
+  // Returns whether all points below the node are marked
+  template<typename R>
+  bool union_node(Node_handle node, const Rectangle& rect, const R& range, union_marks& marks, std::vector<size_t>& res, search_context<FT>& context, query_stats& stats) const {
+    if (marks.nodes.count(node) != 0) {
+      return true;
+    }
+    if (!range.inner_range_intersects(rect)) {
+      return false;
+    }
+    bool full = true;
+    if (range.outer_range_contains(rect)) {
+      std::vector<size_t>& subtree = context.keys;
+      subtree.clear();
+      collect_subtree(node, subtree, stats);
+      for (auto iter = subtree.begin(); iter != subtree.end(); iter++) {
+        if (marks.points[*iter]) continue;
+        marks.points[*iter] = true;
         res.push_back(*iter);
-        ids.push_back(i + 1);
       }
+    } else if (node->is_leaf()) {
+      stats.nodes++;
+      stats.leaves++;
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(node);
+      for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+        if (marks.points[*iter]) continue;
+        stats.distances++;
+        if (range.contains(*iter)) {
+          marks.points[*iter] = true;
+          res.push_back(*iter);
+        } else {
+          full = false;
+        }
+      }
+    } else {
+      stats.nodes++;
+      typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(node);
+      Rectangle lower(rect);
+      Rectangle upper(rect);
+      lower.split(upper, internal->cutting_dimension(), internal->cutting_value());
+      bool lower_full = union_node(internal->lower(), lower, range, marks, res, context, stats);
+      bool upper_full = union_node(internal->upper(), upper, range, marks, res, context, stats);
+      full = lower_full && upper_full;
     }
-    return cpp11::writable::list({
-      "points"_nm = create_euclid_vec(res),
-      "id"_nm = ids
+    if (full) {
+      marks.nodes.insert(node);
+    }
+    return full;
+  }
+
+  // Queries are answered in the given order, or in input order if it is empty.
+  // make_range creates the CGAL range for a query
+  template<typename F>
+  cpp11::writable::list range_impl(size_t n_queries, const std::vector<size_t>& order, bool index, bool stats, int threads, bool unique, F make_range) const {
+    size_t n_threads = query_threads<K>(threads);
+    std::vector<chunk> chunks = split_chunks(n_queries, n_threads);
+    std::vector<hit_buffer> buffers(chunks.size());
+    std::vector<query_stats> stats_vec(stats ? n_queries : 0);
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      hit_buffer& buffer = buffers[c];
+      search_context<FT> context;
+      union_marks marks;
+      if (unique) {
+        marks.points.resize(_points.size(), false);
+      }
+      for (size_t pos = chunks[c].begin; pos < chunks[c].end; ++pos) {
+        size_t i = order.empty() ? pos : order[pos];
+        auto range = make_range(i);
+        if (unique) {
+          query_stats union_stats;
+          union_range(range, marks, buffer.index, context, union_stats);
+          if (stats) stats_vec[i] = union_stats;
+        } else {
+          search_range(range, buffer.index, stats ? &stats_vec[i] : nullptr);
+        }
+        buffer.id.resize(buffer.index.size(), i + 1);
+      }
     });
+    if (unique) {
+      merge_union_hits(buffers, _points.size(), [](size_t i) { return i; });
+    } else if (!order.empty()) {
+      restore_query_order(buffers, n_queries);
+    }
+    cpp11::writable::list res = assemble_result(buffers, index, false, [](size_t i) { return i; }, [this](size_t i) { return to_exact_kernel(_points[i]); });
+    if (stats) {
+      res.push_back("stats"_nm = assemble_stats(stats_vec));
+    }
+    return res;
   }
 
-private:
-  template<typename Q, typename D, typename S>
-  cpp11::writable::list search_impl(std::vector<Q>& queries, cpp11::integers n, D dist, SEXP eps, bool nearest, bool sort) const {
-    std::vector<Exact_number> eps_vec = euclid::get_exact_numeric_vec(eps);
-    std::vector<Point> res;
-    cpp11::writable::integers ids;
-    cpp11::writable::doubles distances;
-    size_t i = 0;
-    for (auto iter = queries.begin(); iter != queries.end(); iter++) {
-      S s(_tree, *iter, n[i % n.size()], eps_vec[i % eps_vec.size()], nearest, dist, sort);
-      i++;
-      for (auto iter_p = s.begin(); iter_p != s.end(); iter_p++) {
-        res.push_back(iter_p->first);
-        ids.push_back(i);
-        distances.push_back(CGAL::to_double(iter_p->second));
+  // CGAL searches can't be given an initial bound on the distance or a leaf
+  // budget so searches with either use their own traversal, mirroring the one
+  // of flat trees. The closest child is visited first and nodes are pruned
+  // when they lie beyond the bound or can't improve on the worst candidate,
+  // kept at the top of the heap, by more than the eps factor
+  typedef std::pair<FT, size_t> Hit;
+  template<typename Q, typename D, typename C>
+  void bounded_node(Node_handle node, const Rectangle& rect, const Q& query, const D& dist, size_t k, const FT& factor, const FT& bound, std::vector<Hit>& heap, C comp, leaf_budget& budget, query_stats& stats) const {
+    if (!budget.available()) {
+      return;
+    }
+    stats.nodes++;
+    if (node->is_leaf()) {
+      stats.leaves++;
+      budget.spend();
+      typename Tree::Leaf_node_const_handle leaf = static_cast<typename Tree::Leaf_node_const_handle>(node);
+      for (auto iter = leaf->begin(); iter != leaf->end(); iter++) {
+        stats.distances++;
+        Hit hit(dist.transformed_distance(query, *iter), *iter);
+        if (hit.first > bound) continue;
+        if (heap.size() < k) {
+          heap.push_back(hit);
+          std::push_heap(heap.begin(), heap.end(), comp);
+        } else if (comp(hit, heap.front())) {
+          std::pop_heap(heap.begin(), heap.end(), comp);
+          heap.back() = hit;
+          std::push_heap(heap.begin(), heap.end(), comp);
+        }
       }
+      return;
     }
-    return cpp11::writable::list({
-      "points"_nm = create_euclid_vec(res),
-      "id"_nm = ids,
-      "distance"_nm = distances
+    typename Tree::Internal_node_const_handle internal = static_cast<typename Tree::Internal_node_const_handle>(node);
+    Rectangle lower(rect);
+    Rectangle upper(rect);
+    lower.split(upper, internal->cutting_dimension(), internal->cutting_value());
+    Node_handle children[2] = {internal->lower(), internal->upper()};
+    const Rectangle* rects[2] = {&lower, &upper};
+    FT lows[2];
+    FT bounds[2];
+    for (size_t c = 0; c < 2; ++c) {
+      lows[c] = dist.min_distance_to_rectangle(query, *rects[c]);
+      bounds[c] = nearest(comp) ? lows[c] : dist.max_distance_to_rectangle(query, *rects[c]);
+    }
+    // Visit the most promising child first
+    if (nearest(comp) ? bounds[1] < bounds[0] : bounds[1] > bounds[0]) {
+      std::swap(children[0], children[1]);
+      std::swap(rects[0], rects[1]);
+      std::swap(lows[0], lows[1]);
+      std::swap(bounds[0], bounds[1]);
+    }
+    for (size_t c = 0; c < 2; ++c) {
+      if (lows[c] > bound) continue;
+      if (heap.size() == k) {
+        if (nearest(comp) ? bounds[c] * factor >= heap.front().first : bounds[c] <= heap.front().first * factor) continue;
+      }
+      bounded_node(children[c], *rects[c], query, dist, k, factor, bound, heap, comp, budget, stats);
+    }
+  }
+  static bool nearest(std::less<Hit>) { return true; }
+  static bool nearest(std::greater<Hit>) { return false; }
+
+  // The neighbors are written to the hits of the context. `max_dist` is given
+  // in the transformed space of the distance and only used if `bounded`
+  template<typename Q, typename D, typename C>
+  void bounded_search(const Q& query, const D& dist, size_t k, const FT& eps, bool bounded, const FT& max_dist, bool sort, C comp, leaf_budget& budget, search_context<FT>& context, query_stats& stats) const {
+    std::vector<Hit>& heap = context.heap;
+    heap.clear();
+    context.hits.clear();
+    if (k != 0 && _n_in_tree != 0) {
+      // Without a maximum distance all points lie within the largest distance
+      // to the bounding box. Distances are never negative but the distance to
+      // the box may be for spheroids containing it
+      FT bound = bounded ? max_dist : std::max(dist.max_distance_to_rectangle(query, _tree->bounding_box()), FT(0));
+      if (dist.min_distance_to_rectangle(query, _tree->bounding_box()) <= bound) {
+        bounded_node(_tree->root(), _tree->bounding_box(), query, dist, k, dist.transformed_distance(FT(1) + eps), bound, heap, comp, budget, stats);
+      }
+    }
+    if (sort) {
+      std::sort_heap(heap.begin(), heap.end(), comp);
+    }
+    for (auto iter = heap.begin(); iter != heap.end(); iter++) {
+      context.hits.emplace_back(iter->second, iter->first);
+    }
+  }
+
+  // The maximum distance is given in the units of the coordinates and converted
+  // to the transformed distance of the query. Spheroid distances are reported
+  // as |p - c|^2 - r^2 so a point at most d outside the spheroid has a distance
+  // of at most (r + d)^2 - r^2
+  template<typename Q, typename D>
+  FT search_bound(const Q& query, const D& dist, double d) const {
+    return dist.transformed_distance(FT(d));
+  }
+  template<typename D>
+  FT search_bound(const Spheroid& query, const D& dist, double d) const {
+    FT r = radius_from_squared(query.squared_radius());
+    return FT(d) * (FT(d) + FT(2) * r);
+  }
+
+  template<typename Q, typename D, typename S>
+  cpp11::writable::list search_impl(std::vector<Q>& queries, cpp11::integers n, D dist, SEXP eps, cpp11::doubles max_distance, cpp11::doubles max_leaves, bool nearest, bool sort, bool index, bool stats, int threads, bool reorder) const {
+    std::vector<FT> eps_vec = get_ft_vec<FT>(eps);
+    std::vector<int> n_vec(n.begin(), n.end());
+    std::vector<double> bound_vec(max_distance.begin(), max_distance.end());
+    std::vector<double> leaves_vec(max_leaves.begin(), max_leaves.end());
+    bool budgeted = std::any_of(leaves_vec.begin(), leaves_vec.end(), [](double l) { return !std::isinf(l); });
+    size_t n_threads = query_threads<K>(threads);
+    std::vector<chunk> chunks = split_chunks(queries.size(), n_threads);
+    std::vector<hit_buffer> buffers(chunks.size());
+    std::vector<query_stats> stats_vec(stats ? queries.size() : 0);
+    std::vector<char> exact_vec(budgeted ? queries.size() : 0, true);
+    std::vector<size_t> order = reorder ? morton_order(queries, dim) : std::vector<size_t>();
+    parallel_for(chunks.size(), n_threads, [&](size_t c) {
+      hit_buffer& buffer = buffers[c];
+      search_context<FT> context;
+      std::vector< std::pair<size_t, FT> >& hits = context.hits;
+      for (size_t pos = chunks[c].begin; pos < chunks[c].end; ++pos) {
+        size_t i = order.empty() ? pos : order[pos];
+        int k = n_vec[i % n_vec.size()];
+        bool bounded = !std::isinf(bound_vec[i % bound_vec.size()]);
+        FT max_dist = bounded ? search_bound(queries[i], dist, bound_vec[i % bound_vec.size()]) : FT(0);
+        leaf_budget budget(leaves_vec[i % leaves_vec.size()]);
+        if (bounded || !std::isinf(leaves_vec[i % leaves_vec.size()])) {
+          query_stats bounded_stats;
+          if (nearest) {
+            bounded_search(queries[i], dist, std::max(k, 0), eps_vec[i % eps_vec.size()], bounded, max_dist, sort, std::less<Hit>(), budget, context, bounded_stats);
+          } else {
+            bounded_search(queries[i], dist, std::max(k, 0), eps_vec[i % eps_vec.size()], bounded, max_dist, sort, std::greater<Hit>(), budget, context, bounded_stats);
+          }
+          if (budgeted) {
+            exact_vec[i] = budget.exact;
+          }
+          if (stats) {
+            stats_vec[i] = bounded_stats;
+            stats_vec[i].distances += _buffer.size();
+          }
+        } else {
+          instrumented_search<S> s(*_tree, queries[i], k, eps_vec[i % eps_vec.size()], nearest, dist, sort);
+          if (stats) {
+            stats_vec[i] = s.stats();
+            stats_vec[i].distances += _buffer.size();
+          }
+          hits.assign(s.begin(), s.end());
+        }
+        if (_buffer.empty()) {
+          for (auto iter_h = hits.begin(); iter_h != hits.end(); iter_h++) {
+            buffer.index.push_back(iter_h->first);
+            buffer.id.push_back(i + 1);
+            buffer.distance.push_back(CGAL::to_double(iter_h->second));
+          }
+          continue;
+        }
+        // Merge the neighbors found in the tree with the buffered points
+        for (auto iter_b = _buffer.begin(); iter_b != _buffer.end(); iter_b++) {
+          FT d = dist.transformed_distance(queries[i], *iter_b);
+          if (bounded && d > max_dist) continue;
+          hits.emplace_back(*iter_b, d);
+        }
+        size_t n_keep = std::min(size_t(std::max(k, 0)), hits.size());
+        std::partial_sort(hits.begin(), hits.begin() + n_keep, hits.end(), [nearest](const std::pair<size_t, FT>& a, const std::pair<size_t, FT>& b) {
+          return nearest ? a.second < b.second : a.second > b.second;
+        });
+        for (size_t j = 0; j < n_keep; ++j) {
+          buffer.index.push_back(hits[j].first);
+          buffer.id.push_back(i + 1);
+          buffer.distance.push_back(CGAL::to_double(hits[j].second));
+        }
+      }
     });
+    if (!order.empty()) {
+      restore_query_order(buffers, queries.size());
+    }
+    cpp11::writable::list res = assemble_result(buffers, index, true, [](size_t i) { return i; }, [this](size_t i) { return to_exact_kernel(_points[i]); });
+    if (budgeted) {
+      res.push_back("exact"_nm = assemble_exact(exact_vec));
+    }
+    if (stats) {
+      res.push_back("stats"_nm = assemble_stats(stats_vec));
+    }
+    return res;
   }
+
+  // Cursors use the incremental search of CGAL, which keeps its queue of nodes
+  // and points between calls. Buffered points are sorted by distance up front
+  // and merged in as the search proceeds. A cursor refuses to continue once the
+  // tree has changed as the nodes it has queued may no longer exist
+  class incremental_cursor : public neighbor_cursor {
+    typedef CGAL::Distance_adapter<size_t, Point_map, CGAL::Euclidean_distance<Base_traits> > Dist;
+    typedef CGAL::Orthogonal_incremental_neighbor_search<Traits, Dist, Splitter, Tree> Search;
+
+    const tree* _owner;
+    size_t _revision;
+    bool _nearest;
+    std::unique_ptr<Search> _search;
+    typename Search::iterator _iter;
+    std::vector<Hit> _buffered;
+    size_t _next_buffered;
+    size_t _position;
+
+  public:
+    incremental_cursor(const tree* owner, const Point& query, bool nearest) :
+      _owner(owner), _revision(owner->_revision), _nearest(nearest), _next_buffered(0), _position(0) {
+      Point_map pmap(&owner->_points);
+      Dist dist(pmap);
+      if (owner->_n_in_tree != 0) {
+        _search.reset(new Search(*owner->_tree, query, FT(0), nearest, dist));
+        _iter = _search->begin();
+      }
+      for (auto iter = owner->_buffer.begin(); iter != owner->_buffer.end(); iter++) {
+        _buffered.emplace_back(dist.transformed_distance(query, *iter), *iter);
+      }
+      if (nearest) {
+        std::sort(_buffered.begin(), _buffered.end());
+      } else {
+        std::sort(_buffered.begin(), _buffered.end(), std::greater<Hit>());
+      }
+    }
+
+    cpp11::writable::list next(size_t n, bool index) {
+      if (_owner->_revision != _revision) {
+        cpp11::stop("The tree has been modified since the cursor was created");
+      }
+      std::vector<hit_buffer> buffers(1);
+      hit_buffer& buffer = buffers[0];
+      while (buffer.index.size() < n && !exhausted()) {
+        bool from_tree = !tree_exhausted();
+        if (from_tree && _next_buffered < _buffered.size()) {
+          const FT& d = (*_iter).second;
+          const FT& b = _buffered[_next_buffered].first;
+          from_tree = _nearest ? !(b < d) : !(d < b);
+        }
+        if (from_tree) {
+          buffer.index.push_back((*_iter).first);
+          buffer.distance.push_back(CGAL::to_double((*_iter).second));
+          ++_iter;
+        } else {
+          buffer.index.push_back(_buffered[_next_buffered].second);
+          buffer.distance.push_back(CGAL::to_double(_buffered[_next_buffered].first));
+          _next_buffered++;
+        }
+        buffer.id.push_back(++_position);
+      }
+      return assemble_result(buffers, index, true, [](size_t i) { return i; }, [this](size_t i) { return to_exact_kernel(_owner->_points[i]); });
+    }
+    bool exhausted() const {
+      return tree_exhausted() && _next_buffered == _buffered.size();
+    }
+    size_t position() const { return _position; }
+
+  private:
+    bool tree_exhausted() const {
+      return _search == nullptr || _iter == _search->end();
+    }
+  };
 };